@@ -22,18 +22,42 @@
 #include <stdio.h>
 
 #include "nulib.h"
-#include "nulib/hashtable.h"
-#include "nulib/queue.h"
 #include "nulib/string.h"
-#include "nulib/vector.h"
-
-declare_hashtable_string_type(arcindex, int);
 
 enum {
 	ARCHIVE_MMAP = 1,   // map archive in memory
 	ARCHIVE_RAW  = 2,   // skip decompression when loading files
 	ARCHIVE_CACHE = 4,  // cache loaded files
 	ARCHIVE_STEREO = 8, // raw PCM is stereo (AWD/AWF archives)
+	ARCHIVE_THREADSAFE = 16, // allow concurrent access from multiple threads
+	ARCHIVE_PREAD = 32,      // read files with pread(2) instead of stdio
+	ARCHIVE_SEQUENTIAL = 64, // files will be accessed sequentially (e.g. extraction)
+	ARCHIVE_RANDOM = 128,    // files will be accessed randomly (e.g. at runtime)
+	ARCHIVE_POPULATE = 256,  // pre-fault the whole mapping at open (ARCHIVE_MMAP)
+	ARCHIVE_HUGEPAGE = 512,  // back the mapping with huge pages if possible (ARCHIVE_MMAP)
+	ARCHIVE_INDEX_SIDECAR = 1024, // load/store the decoded index in <path>.idx
+	ARCHIVE_LZSS_CHECKPOINTS = 2048, // record LZSS checkpoints for stream seeking
+};
+
+enum archive_cache_policy {
+	// least recently used
+	ARCHIVE_CACHE_LRU,
+	// 2Q: new entries enter a small probationary FIFO and are only promoted
+	// to the main LRU queue if they are loaded again after being evicted
+	// from it (scan resistant)
+	ARCHIVE_CACHE_2Q,
+};
+
+enum archive_priority {
+	ARCHIVE_PRIORITY_NORMAL,
+	ARCHIVE_PRIORITY_LOW,  // never cached (e.g. one-off extraction)
+	ARCHIVE_PRIORITY_HIGH, // skips the probationary queue under 2Q
+};
+
+enum archive_access {
+	ARCHIVE_ACCESS_NORMAL,
+	ARCHIVE_ACCESS_SEQUENTIAL,
+	ARCHIVE_ACCESS_RANDOM,
 };
 
 enum archive_scheme {
@@ -73,22 +97,27 @@ struct arc_metadata {
 	enum archive_type type;
 };
 
+struct archive_stats {
+	uint64_t cache_hits;         // loads of entries that were already loaded
+	uint64_t cache_misses;       // loads that had to read the entry
+	uint64_t cache_evictions;    // entries evicted from the cache
+	uint64_t bytes_read;         // bytes read from the archive file
+	uint64_t bytes_mapped;       // bytes served from the mapped region
+	uint64_t bytes_decompressed; // bytes output by LZSS decompression
+	uint64_t read_ns;            // time spent reading the archive file
+	uint64_t lzss_ns;            // time spent in LZSS decompression
+	uint64_t wav_ns;             // time spent converting PCM to WAV
+	uint64_t resident_bytes;     // bytes currently held by the cache
+};
+
+/*
+ * Archives and entry handles are created by the library and carry private
+ * state after the fields below; they must not be allocated or copied by
+ * callers.
+ */
 struct archive {
-	hashtable_t(arcindex) index;
-	TAILQ_HEAD(cache_head, archive_data) cache;
-	unsigned nr_cached;
-	unsigned cache_size;
-	vector_t(struct archive_data) files;
 	struct arc_metadata meta;
 	unsigned flags;
-	bool mapped;
-	union {
-		FILE *fp;
-		struct {
-			uint8_t *data;
-			size_t size;
-		} map;
-	};
 };
 
 enum awd_file_type {
@@ -103,34 +132,108 @@ struct awd_file_metadata {
 };
 
 struct archive_data {
-	TAILQ_ENTRY(archive_data) entry;
 	uint32_t offset;
 	uint32_t raw_size; // size of file in archive
 	uint32_t size;     // size of data in `data` (uncompressed)
 	string name;
 	uint8_t *data;
 	struct awd_file_metadata meta;
-	unsigned int ref : 16;      // reference count
-	unsigned int mapped : 1;    // true if `data` is a pointer into mmapped region
-	unsigned int allocated : 1; // true if archive_data object needs to be freed
-	unsigned int cached : 1;
-	unsigned int reserved : 13; // reserved for future flags
 	struct archive *archive;
 };
 
 /*
- * Close an archive.
+ * Close an archive. Entries that are still pinned are unpinned; entries must
+ * not be used (or unpinned) after the archive is closed.
  */
 void archive_close(struct archive *arc)
 	attr_nonnull;
 
 /*
  * Open an archive.
+ *
+ * If ARCHIVE_THREADSAFE is given, the returned archive may be accessed from
+ * multiple threads concurrently. Entries are read without sharing a file
+ * position, and decompression happens outside of the archive lock, so
+ * loads of distinct entries proceed in parallel.
+ *
+ * If ARCHIVE_PREAD is given (implied by ARCHIVE_THREADSAFE when the archive
+ * is not mapped), entries are read with positional reads on a raw file
+ * descriptor directly into their destination buffers, bypassing stdio
+ * buffering.
+ *
+ * If ARCHIVE_INDEX_SIDECAR is given, the detected metadata and decoded index
+ * are stored in a sidecar file next to the archive (<path>.idx) and reused
+ * by later opens, as long as the archive's size, mtime and header are
+ * unchanged. Failure to read or write the sidecar is not an error.
  */
 struct archive *archive_open(const char *path, unsigned flags)
 	attr_dealloc(archive_close, 1)
 	attr_nonnull;
 
+/*
+ * Set the byte budget for an archive's cache. The budget is measured in
+ * (decompressed) bytes of cached entry data; entries which point into a
+ * mapped region are free. A budget of 0 disables caching.
+ */
+void archive_set_cache_limit(struct archive *arc, size_t bytes)
+	attr_nonnull;
+
+/*
+ * Set a process-wide byte budget shared by the caches of all open archives.
+ * When the budget is exceeded, the least recently used cached entries are
+ * evicted from whichever archive holds them. A budget of 0 means no limit.
+ *
+ * NOTE: Loading an entry from one archive may evict entries from another;
+ *       archives used from more than one thread must be opened with
+ *       ARCHIVE_THREADSAFE.
+ */
+void archive_set_global_cache_limit(size_t bytes);
+
+/*
+ * Set the replacement policy for an archive's cache. The cache is flushed.
+ */
+void archive_set_cache_policy(struct archive *arc, enum archive_cache_policy policy)
+	attr_nonnull;
+
+/*
+ * Pin a loaded entry in memory. The entry is removed from the cache (and
+ * does not count towards its budget) and its data stays loaded until it is
+ * unpinned, regardless of other references. The caller must own a reference
+ * to the entry.
+ */
+void archive_data_pin(struct archive_data *data)
+	attr_nonnull;
+
+void archive_data_unpin(struct archive_data *data)
+	attr_nonnull;
+
+/*
+ * Set a caching hint for an entry.
+ */
+void archive_data_set_priority(struct archive_data *data, enum archive_priority priority)
+	attr_nonnull;
+
+/*
+ * Get I/O and cache statistics for an archive.
+ */
+void archive_get_stats(struct archive *arc, struct archive_stats *out)
+	attr_nonnull;
+
+/*
+ * Get I/O and cache statistics summed over all archives opened by the
+ * process. `resident_bytes` is the total held by all caches.
+ */
+void archive_get_global_stats(struct archive_stats *out)
+	attr_nonnull;
+
+/*
+ * Reset the statistics counters (except `resident_bytes`).
+ */
+void archive_reset_stats(struct archive *arc)
+	attr_nonnull;
+
+void archive_reset_global_stats(void);
+
 /*
  * Release a reference to an entry. If the reference count becomes zero, the
  * loaded data is free'd.
@@ -150,7 +253,60 @@ struct archive_data *archive_get_by_index(struct archive *arc, unsigned i)
 	attr_nonnull;
 
 /*
- * Get the index of an entry by name.
+ * Get several entries by name. On return, `out[i]` is the loaded entry for
+ * `names[i]` (and the caller owns a reference to it), or NULL if the entry
+ * does not exist or could not be loaded. Returns the number of entries
+ * loaded.
+ *
+ * This is faster than calling `archive_get` in a loop: reads are sorted by
+ * offset and nearby entries are coalesced into large sequential reads, and
+ * entries are decompressed in parallel.
+ */
+unsigned archive_get_batch(struct archive *arc, const char **names, unsigned n,
+		struct archive_data **out)
+	attr_nonnull;
+
+/*
+ * Callback for `archive_extract_all`. `data` is the loaded data for `file`
+ * and is only valid until the callback returns. Return false to stop the
+ * extraction.
+ */
+typedef bool (*archive_extract_callback)(struct archive_data *file, const uint8_t *data,
+		size_t size, void *user);
+
+/*
+ * Load every entry of an archive and pass it to `callback`. Entries are read
+ * and decompressed on `nr_threads` threads (0 means one per processor), with
+ * the amount of data in flight bounded by a fixed byte budget. Callbacks are
+ * never run concurrently. If `ordered` is true, entries are delivered in
+ * index order; otherwise they are delivered as soon as they are ready.
+ *
+ * The archive cache is bypassed. Returns false if any entry failed to load
+ * or the callback stopped the extraction.
+ */
+bool archive_extract_all(struct archive *arc, archive_extract_callback callback,
+		void *user, unsigned nr_threads, bool ordered);
+
+/*
+ * Declare the expected access pattern for an archive. This is advisory only;
+ * it tunes kernel readahead for the mapped region or file.
+ */
+void archive_advise(struct archive *arc, enum archive_access access)
+	attr_nonnull;
+
+/*
+ * Start reading an entry's data in the background, ahead of a later call to
+ * `archive_get`. Returns false if the entry does not exist.
+ */
+bool archive_prefetch(struct archive *arc, const char *name)
+	attr_nonnull;
+
+void archive_prefetch_by_index(struct archive *arc, unsigned i)
+	attr_nonnull;
+
+/*
+ * Get the index of an entry by name. Names are compared case-insensitively
+ * (ASCII only). Returns -1 if there is no such entry.
  */
 int archive_get_index(struct archive *arc, const char *name)
 	attr_nonnull;
@@ -166,13 +322,181 @@ bool archive_data_load(struct archive_data *data)
 	attr_warn_unused_result
 	attr_nonnull;
 
+/*
+ * A WAV file presented as two pieces: a synthesized header and the PCM data
+ * as stored in the archive (e.g. for writev(2) or an audio API that accepts
+ * separate buffers).
+ */
+struct archive_wav {
+	uint8_t header[44];
+	const uint8_t *pcm;
+	size_t pcm_size;
+	struct archive_data *data; // entry holding `pcm`, if not mapped
+};
+
+/*
+ * Get a view of an AWD/AWF PCM entry as a WAV file. For mapped archives,
+ * `pcm` points directly into the mapped region and nothing is allocated or
+ * copied. Otherwise, the entry is loaded (PCM data is read directly after
+ * its WAV header, so it is not copied either) and a reference to it is held
+ * until the view is released.
+ */
+bool archive_get_wav(struct archive *arc, const char *name, struct archive_wav *wav)
+	attr_warn_unused_result
+	attr_nonnull;
+
+bool archive_get_wav_by_index(struct archive *arc, unsigned i, struct archive_wav *wav)
+	attr_warn_unused_result
+	attr_nonnull;
+
+void archive_wav_release(struct archive_wav *wav)
+	attr_nonnull;
+
+struct archive_stream;
+
+/*
+ * Open a stream for reading an entry's data incrementally. A stream yields
+ * the same bytes as `archive_data_load`, but decompresses them on demand
+ * and uses a small, fixed amount of memory regardless of the entry's size.
+ *
+ * Streams are independent of the entry cache. Any number of streams may be
+ * open on an archive; each stream must only be used from one thread at a
+ * time (and from several threads only if the archive is ARCHIVE_THREADSAFE).
+ */
+struct archive_stream *archive_stream_open(struct archive *arc, const char *name)
+	attr_nonnull;
+
+struct archive_stream *archive_stream_open_by_index(struct archive *arc, unsigned i)
+	attr_nonnull;
+
+void archive_stream_close(struct archive_stream *s)
+	attr_nonnull;
+
+/*
+ * Read up to `size` bytes from a stream. Returns the number of bytes read,
+ * which is less than `size` only at the end of the data or on error.
+ */
+size_t archive_stream_read(struct archive_stream *s, void *buf, size_t size)
+	attr_nonnull;
+
+/*
+ * Skip up to `size` bytes. Returns the number of bytes skipped.
+ */
+size_t archive_stream_skip(struct archive_stream *s, size_t size)
+	attr_nonnull;
+
+/*
+ * Seek to `pos` (in bytes of output). Returns false if `pos` is past the
+ * end of the data, in which case the stream is left at the end.
+ *
+ * Seeking in an LZSS compressed entry decompresses everything between the
+ * nearest preceding checkpoint and `pos`. Without checkpoints, that is
+ * everything from the start of the entry (or from the current position,
+ * when seeking forward). With ARCHIVE_LZSS_CHECKPOINTS, a stream saves the
+ * decoder state every ARCHIVE_CHECKPOINT_INTERVAL bytes as it reads. The
+ * checkpoints are kept with the entry and shared by all later streams on
+ * it; loading the entry with `archive_data_load` records all of them.
+ */
+#define ARCHIVE_CHECKPOINT_INTERVAL (128 * 1024)
+
+bool archive_stream_seek(struct archive_stream *s, size_t pos)
+	attr_nonnull;
+
+/*
+ * Get the current position (in bytes of output) of a stream.
+ */
+size_t archive_stream_tell(struct archive_stream *s)
+	attr_nonnull;
+
+/*
+ * Returns true if reading from the archive failed.
+ */
+bool archive_stream_error(struct archive_stream *s)
+	attr_nonnull;
+
+/*
+ * Get the handle for an entry without loading its data. The caller does NOT
+ * own a reference to the entry. Handles are created on first access and
+ * remain valid until the archive is closed.
+ */
+struct archive_data *archive_entry(struct archive *arc, unsigned i)
+	attr_nonnull;
+
+/*
+ * Get the name of entry `i` (in upper case), or NULL if there is no such
+ * entry. The name points into the archive index and is valid until the
+ * archive is closed.
+ */
+const char *archive_entry_name(struct archive *arc, unsigned i)
+	attr_nonnull;
+
 /*
  * Iterate over the list of files in an archive. The caller does NOT own a
  * reference to the entries it iterates over, and data is NOT loaded.
  *
  * The caller must use `archive_data_load` to create a reference and load
  * the file data.
+ *
+ * This creates a handle (with its own copy of the name) for every entry.
+ * To list a large archive, prefer `archive_foreach_index`.
  */
-#define archive_foreach(var, arc) vector_foreach_p(var, (arc)->files)
+#define archive_foreach(var, arc) \
+	for (unsigned _i_##var = 0; _i_##var < (arc)->meta.nr_files \
+			&& ((var) = archive_entry(arc, _i_##var)); _i_##var++)
+
+/*
+ * Iterate over the indices of the files in an archive without creating
+ * handles. Use `archive_entry_name` to get the name of an entry, and
+ * `archive_get_by_index` (or `archive_entry`) to load it.
+ */
+#define archive_foreach_index(i, arc) \
+	for (unsigned i = 0; i < (arc)->meta.nr_files; i++)
+
+/*
+ * Archive writer.
+ *
+ * Entries are added in memory and written out by `archive_writer_write`,
+ * which compresses them in parallel and then writes the header, index and
+ * payloads in a single sequential pass. The layout and cipher of the index
+ * are given by a `struct arc_metadata`, so an archive can be repacked with
+ * the metadata detected when opening the original (`arc->meta`), or a new
+ * one created from `archive_writer_default_metadata`.
+ *
+ * Entries of ARC and DAT archives are LZSS compressed (bitwise for AIWIN
+ * games) unless ARCHIVE_RAW is given. PCM entries of AWD and AWF archives
+ * may be given either as WAV files or as raw PCM data.
+ *
+ * For games whose ARC archives use a game-specific index (see
+ * `ai5_target_game`), the reader always assumes that index, so ARC
+ * archives are written with it regardless of the scheme in the metadata.
+ */
+struct archive_writer;
+
+void archive_writer_default_metadata(enum archive_type type, struct arc_metadata *meta)
+	attr_nonnull;
+
+/*
+ * Create a writer. Returns NULL if the metadata is invalid, e.g. if a field
+ * does not fit in the index entry.
+ */
+struct archive_writer *archive_writer_new(const struct arc_metadata *meta, unsigned flags)
+	attr_nonnull;
+
+void archive_writer_free(struct archive_writer *w)
+	attr_nonnull;
+
+/*
+ * Add an entry. The data is copied. `awd` gives the type and loop points of
+ * AWD/AWF entries and may be NULL (PCM without loop points).
+ */
+void archive_writer_add(struct archive_writer *w, const char *name, const uint8_t *data,
+		size_t size, const struct awd_file_metadata *awd);
+
+/*
+ * Compress the entries on `nr_threads` threads (0 means one per processor)
+ * and write the archive to `path`.
+ */
+bool archive_writer_write(struct archive_writer *w, const char *path, unsigned nr_threads)
+	attr_nonnull;
 
 #endif // AI5_ARC_H
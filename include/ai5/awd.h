@@ -0,0 +1,112 @@
+/* Copyright (C) 2023 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#ifndef AI5_AWD_H
+#define AI5_AWD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "nulib.h"
+
+struct archive;
+
+/*
+ * Pull-style PCM source for AWD/AWF PCM entries.
+ *
+ * Samples are read from the archive (or the mapped region) straight into
+ * the caller's buffer, so memory use does not depend on the length of the
+ * track. If looping is enabled, playback wraps from the entry's loop_end
+ * back to its loop_start without a gap. Loop points are in frames; a
+ * loop_end of 0 (or past the end of the data) means the end of the data.
+ *
+ * Data is 16-bit signed PCM at 44100 Hz, mono or stereo (ARCHIVE_STEREO).
+ */
+struct awd_stream;
+
+struct awd_stream *awd_stream_open(struct archive *arc, const char *name, bool loop)
+	attr_nonnull;
+
+struct awd_stream *awd_stream_open_by_index(struct archive *arc, unsigned i, bool loop)
+	attr_nonnull;
+
+void awd_stream_close(struct awd_stream *s)
+	attr_nonnull;
+
+/*
+ * Read up to `frames` frames of interleaved samples into `out`. Returns the
+ * number of frames read, which is less than `frames` only at the end of a
+ * non-looping stream or on error.
+ */
+size_t awd_stream_read(struct awd_stream *s, int16_t *out, size_t frames)
+	attr_nonnull;
+
+/*
+ * Seek to a frame (relative to the start of the data).
+ */
+bool awd_stream_seek(struct awd_stream *s, uint32_t frame)
+	attr_nonnull;
+
+uint32_t awd_stream_tell(struct awd_stream *s)
+	attr_nonnull;
+
+unsigned awd_stream_channels(struct awd_stream *s)
+	attr_nonnull;
+
+/*
+ * Total number of frames in the data (excluding repetitions).
+ */
+uint32_t awd_stream_length(struct awd_stream *s)
+	attr_nonnull;
+
+/*
+ * Frame index of an AWD_MP3 entry. Offsets are relative to the start of the
+ * entry; `frame_offset[nr_frames]` is the end of the last frame. Leading
+ * ID3v2 tags and a Xing/Info frame are not part of the index.
+ */
+struct awd_mp3_index {
+	uint32_t sample_rate;
+	uint16_t channels;
+	uint16_t samples_per_frame;
+	uint8_t layer;
+	uint32_t nr_frames;
+	uint32_t frame_offset[];
+};
+
+/*
+ * Get the frame index of an MP3 entry. The frame headers are scanned once
+ * and the index is cached with the entry for the lifetime of the archive.
+ */
+const struct awd_mp3_index *awd_mp3_index(struct archive *arc, unsigned i)
+	attr_nonnull;
+
+struct awd_mp3_seek {
+	uint32_t offset; // byte offset in entry at which to start decoding
+	uint32_t frame;  // index of the frame at `offset`
+	uint32_t skip;   // number of decoded samples to discard
+};
+
+/*
+ * Find where to start decoding to output `sample` (per channel) first.
+ * For layer III, decoding starts enough frames earlier to fill the bit
+ * reservoir and the synthesis overlap, so that the output matches decoding
+ * from the start of the stream; `skip` covers the extra frames.
+ */
+bool awd_mp3_seek(const struct awd_mp3_index *idx, uint32_t sample, struct awd_mp3_seek *out)
+	attr_nonnull;
+
+#endif // AI5_AWD_H
@@ -87,4 +87,28 @@ struct bitbuffer;
 int gpx_decode_run_length(struct bitbuffer *b);
 void gpx_decode_offset(struct bitbuffer *b, int *x_off, int *y_off);
 
+/*
+ * Pixel format conversion. Each function converts a row of `w` pixels from
+ * `src` to `dst` (which must not overlap). BGR555 pixels are little endian.
+ */
+void cg_bgr555_to_rgba(uint8_t *dst, const uint8_t *src, unsigned w);
+void cg_bgr_to_rgba(uint8_t *dst, const uint8_t *src, unsigned w);
+void cg_bgra_to_rgba(uint8_t *dst, const uint8_t *src, unsigned w);
+void cg_rgba_to_bgr555(uint8_t *dst, const uint8_t *src, unsigned w);
+void cg_rgba_to_bgr(uint8_t *dst, const uint8_t *src, unsigned w);
+void cg_rgba_to_bgra(uint8_t *dst, const uint8_t *src, unsigned w);
+
+enum cg_convert_isa {
+	CG_CONVERT_SCALAR,
+	CG_CONVERT_SSE2,
+	CG_CONVERT_SSSE3,
+	CG_CONVERT_AVX2,
+};
+
+/*
+ * Use the conversion kernels for `isa`. By default, the best kernels supported
+ * by the CPU are used. Returns false if `isa` is not supported.
+ */
+bool cg_convert_select(enum cg_convert_isa isa);
+
 #endif // AI5_CG_H
@@ -17,6 +17,7 @@
 #ifndef AI5_LZSS_H
 #define AI5_LZSS_H
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -30,10 +31,26 @@ uint8_t *lzss_decompress_with_limit(uint8_t *input, size_t input_size, size_t *o
 	attr_malloc
 	attr_nonnull;
 
+/*
+ * Compression levels: greedy parsing with short hash chains, lazy parsing
+ * (one position of look-ahead), or optimal parsing over the longest match
+ * at each position.
+ */
+enum lzss_level {
+	LZSS_FAST,
+	LZSS_DEFAULT,
+	LZSS_BEST,
+};
+
 uint8_t *lzss_compress(uint8_t *input, size_t input_size, size_t *output_size)
 	attr_malloc
 	attr_nonnull;
 
+uint8_t *lzss_compress_level(uint8_t *input, size_t input_size, enum lzss_level level,
+		size_t *output_size)
+	attr_malloc
+	attr_nonnull;
+
 uint8_t *lzss_bw_decompress(uint8_t *input, size_t input_size, size_t *output_size)
 	attr_malloc
 	attr_nonnull;
@@ -42,4 +59,96 @@ uint8_t *lzss_bw_compress(uint8_t *input, size_t input_size, size_t *output_size
 	attr_malloc
 	attr_nonnull;
 
+uint8_t *lzss_bw_compress_level(uint8_t *input, size_t input_size, enum lzss_level level,
+		size_t *output_size)
+	attr_malloc
+	attr_nonnull;
+
+/*
+ * Decompress into a caller-owned buffer. Decompression stops at the end of
+ * the input or after `out_cap` bytes have been written, whichever comes
+ * first. Returns the number of bytes written.
+ */
+size_t lzss_decompress_into(const uint8_t *in, size_t in_size, uint8_t *out, size_t out_cap);
+
+size_t lzss_bw_decompress_into(const uint8_t *in, size_t in_size, uint8_t *out, size_t out_cap);
+
+/*
+ * Decompress up to `out_cap` bytes, passing the output to `row_fn` one row
+ * of `stride` bytes at a time, as soon as each row is complete. Only a small
+ * window of the output is kept in memory. If the data ends in the middle of
+ * a row, that row is passed zero-padded. Returns the number of bytes
+ * decompressed.
+ */
+typedef void (*lzss_row_callback)(void *user, unsigned row, const uint8_t *data);
+
+size_t lzss_decompress_rows(const uint8_t *in, size_t in_size, size_t stride, size_t out_cap,
+		lzss_row_callback row_fn, void *user);
+
+/*
+ * Incremental LZSS decoder. The decoder keeps the 4 KB ring frame and any
+ * partially copied back-reference, so that data can be decompressed in
+ * pieces of arbitrary size from input supplied in chunks of arbitrary size.
+ */
+struct lzss_decoder {
+	uint8_t frame[0x1000];
+	unsigned frame_pos;
+	// pending back-reference
+	unsigned copy_off;
+	unsigned copy_len;
+	// byte LZSS: remaining control bits (with a sentinel bit above them)
+	unsigned ctl;
+	// bitwise LZSS: bit reservoir (MSB first)
+	uint32_t bits;
+	unsigned nr_bits;
+	// current input chunk
+	const uint8_t *in;
+	size_t in_size;
+	size_t in_pos;
+	bool in_final;
+	bool bitwise;
+	bool done;
+};
+
+void lzss_decoder_init(struct lzss_decoder *d, bool bitwise)
+	attr_nonnull;
+
+/*
+ * Supply the next chunk of input. Any unconsumed bytes of the previous
+ * chunk (`in_size - in_pos`) must be included at the start of the new
+ * chunk. If `final` is true, the end of the chunk is the end of the
+ * compressed data.
+ */
+void lzss_decoder_input(struct lzss_decoder *d, const uint8_t *in, size_t size, bool final);
+
+/*
+ * Decompress up to `size` bytes into `out`. Returns the number of bytes
+ * written, which is less than `size` only if the decoder needs more input
+ * or reached the end of the compressed data (`done`).
+ */
+size_t lzss_decoder_read(struct lzss_decoder *d, uint8_t *out, size_t size)
+	attr_nonnull;
+
+/*
+ * Snapshot of the decoder state, not including the input. Decoding can be
+ * resumed from a checkpoint by restoring it and then supplying the input
+ * which follows the bytes consumed at the time it was saved.
+ */
+struct lzss_checkpoint {
+	uint8_t frame[0x1000];
+	unsigned frame_pos;
+	unsigned copy_off;
+	unsigned copy_len;
+	unsigned ctl;
+	uint32_t bits;
+	unsigned nr_bits;
+	bool done;
+};
+
+void lzss_decoder_save(const struct lzss_decoder *d, struct lzss_checkpoint *cp)
+	attr_nonnull;
+
+void lzss_decoder_restore(struct lzss_decoder *d, const struct lzss_checkpoint *cp)
+	attr_nonnull;
+
 #endif // NULIB_LZSS_H
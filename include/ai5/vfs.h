@@ -0,0 +1,91 @@
+/* Copyright (C) 2023 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#ifndef AI5_VFS_H
+#define AI5_VFS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "nulib.h"
+
+struct archive;
+struct archive_data;
+
+/*
+ * Mount table for several archives. The indexes of all mounted archives are
+ * merged into a single name table, so that looking up a name costs one hash
+ * probe regardless of the number of archives. When two archives contain the
+ * same name, the one mounted later shadows the earlier one.
+ *
+ * The caches of the mounted archives share one byte budget (see
+ * `archive_vfs_set_cache_limit`).
+ *
+ * Mounting and unmounting must not happen concurrently with lookups.
+ */
+struct archive_vfs;
+
+struct archive_vfs *archive_vfs_new(void);
+
+/*
+ * Free the mount table. Mounted archives are closed.
+ */
+void archive_vfs_free(struct archive_vfs *vfs)
+	attr_nonnull;
+
+/*
+ * Mount an archive. The mount table takes ownership of the archive.
+ */
+void archive_vfs_mount(struct archive_vfs *vfs, struct archive *arc)
+	attr_nonnull;
+
+/*
+ * Open and mount an archive. Returns the archive, or NULL if it could not be
+ * opened.
+ */
+struct archive *archive_vfs_mount_path(struct archive_vfs *vfs, const char *path,
+		unsigned flags)
+	attr_nonnull;
+
+/*
+ * Unmount an archive. Ownership of the archive returns to the caller.
+ */
+bool archive_vfs_unmount(struct archive_vfs *vfs, struct archive *arc)
+	attr_nonnull;
+
+/*
+ * Get the entry for a name (without loading it). Names are compared
+ * case-insensitively (ASCII only). Returns NULL if no mounted archive
+ * contains the name.
+ */
+struct archive_data *archive_vfs_entry(struct archive_vfs *vfs, const char *name)
+	attr_nonnull;
+
+/*
+ * Get an entry by name. The entry data is loaded and the caller owns a
+ * reference to the entry when this function returns.
+ */
+struct archive_data *archive_vfs_get(struct archive_vfs *vfs, const char *name)
+	attr_nonnull;
+
+/*
+ * Set the byte budget shared by the caches of all mounted archives. A budget
+ * of 0 means no shared limit (each archive's own limit still applies).
+ */
+void archive_vfs_set_cache_limit(struct archive_vfs *vfs, size_t bytes)
+	attr_nonnull;
+
+#endif // AI5_VFS_H
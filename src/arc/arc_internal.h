@@ -0,0 +1,200 @@
+/* Copyright (C) 2023 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#ifndef AI5_ARC_INTERNAL_H
+#define AI5_ARC_INTERNAL_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "nulib/queue.h"
+#include "nulib/string.h"
+#include "ai5/arc.h"
+
+/*
+ * Definitions shared by the archive implementation (src/arc). Not installed.
+ */
+
+struct archive_counters {
+	atomic_uint_fast64_t cache_hits;
+	atomic_uint_fast64_t cache_misses;
+	atomic_uint_fast64_t cache_evictions;
+	atomic_uint_fast64_t bytes_read;
+	atomic_uint_fast64_t bytes_mapped;
+	atomic_uint_fast64_t bytes_decompressed;
+	atomic_uint_fast64_t read_ns;
+	atomic_uint_fast64_t lzss_ns;
+	atomic_uint_fast64_t wav_ns;
+};
+
+/*
+ * Minimal perfect hash table mapping names to 32-bit values.
+ */
+struct arc_name_table {
+	uint32_t *disp;  // per-bucket displacement
+	uint32_t *slots; // value per slot
+	uint32_t nr_buckets;
+	uint32_t nr_slots;
+	uint32_t seed;
+};
+
+struct awd_mp3_index;
+struct archive_checkpoints;
+
+/*
+ * Private state of an archive. The public `struct archive` is the first
+ * member, so the two convert both ways (see arc_priv).
+ */
+struct arc_private {
+	struct archive pub;
+	// packed file index (see src/arc/index.c)
+	struct {
+		uint32_t *offset;
+		uint32_t *raw_size;
+		uint32_t *name_off;   // offset of name in string pool
+		uint32_t *loop_start; // AWD/AWF only
+		uint32_t *loop_end;   // AWD/AWF only
+		uint16_t *awd_type;   // AWD/AWF only
+		char *names;          // string pool (upper case names)
+		size_t names_size;
+		size_t names_cap;
+		// minimal perfect hash of names (see arc_name_table_build)
+		struct arc_name_table table;
+	} index;
+	// per-entry handles, created on first access
+	_Atomic(struct archive_data*) *handles;
+	// mapped index sidecar (ARCHIVE_INDEX_SIDECAR)
+	struct {
+		uint8_t *data;
+		size_t size;
+	} sidecar;
+	TAILQ_HEAD(cache_head, arc_data_private) cache;
+	struct cache_head probation; // 2Q probationary queue
+	unsigned nr_cached;
+	size_t cache_used;  // bytes held by the cache
+	size_t cache_limit; // byte budget for the cache
+	size_t probation_used;
+	enum archive_cache_policy cache_policy;
+	// ring buffer of entries recently evicted from the probationary queue
+	uint32_t *ghosts;
+	unsigned nr_ghosts;
+	unsigned ghost_pos;
+	struct archive_counters stats;
+	TAILQ_ENTRY(arc_private) budget_entry; // entry in cache group
+	struct arc_cache_group *group;         // cache budget group
+	bool mapped;
+	bool use_pread;
+	// protects the cache and entry load state (ARCHIVE_THREADSAFE only)
+	pthread_mutex_t lock;
+	pthread_cond_t load_cond;
+	union {
+		FILE *fp;
+		int fd;
+		struct {
+			uint8_t *data;
+			size_t size;
+		} map;
+	};
+};
+
+/*
+ * Private state of an entry handle (see arc_data_priv).
+ */
+struct arc_data_private {
+	struct archive_data pub;
+	TAILQ_ENTRY(arc_data_private) entry;
+	uint32_t index;             // index of entry in archive
+	uint64_t last_use;          // cache clock value at last access
+	uint32_t ghost_slot;        // slot in the ghost ring (valid if `ghost` is set)
+	atomic_uint ref;            // reference count
+	unsigned int mapped : 1;    // true if `data` is a pointer into mmapped region
+	unsigned int allocated : 1; // true if archive_data object needs to be freed
+	unsigned int cached : 1;
+	unsigned int loading : 1;   // true while another thread is loading `data`
+	unsigned int probation : 1; // true if in the 2Q probationary queue
+	unsigned int ghost : 1;     // true if recently evicted from the probationary queue
+	unsigned int pinned : 1;    // true if pinned in memory
+	unsigned int priority : 2;  // enum archive_priority
+	// MP3 frame index, built on first seek (see awd_mp3_index)
+	_Atomic(struct awd_mp3_index*) mp3;
+	// LZSS checkpoints, recorded by streams and by archive_data_load
+	// (see archive_stream_seek); guarded by the archive lock
+	struct archive_checkpoints *checkpoints;
+};
+
+static inline struct arc_private *arc_priv(struct archive *arc)
+{
+	return (struct arc_private*)arc;
+}
+
+static inline struct arc_data_private *arc_data_priv(struct archive_data *data)
+{
+	return (struct arc_data_private*)data;
+}
+
+// src/arc/open.c
+void arc_lock(struct archive *arc);
+void arc_unlock(struct archive *arc);
+bool arc_read(struct archive *arc, uint8_t *buf, size_t size, off_t off);
+void arc_write_wav_header(uint8_t *data, size_t size_in, bool stereo);
+struct arc_cache_group *arc_cache_group_new(void);
+void arc_cache_group_free(struct arc_cache_group *group);
+void arc_cache_group_set_limit(struct arc_cache_group *group, size_t bytes);
+void arc_set_cache_group(struct archive *arc, struct arc_cache_group *group);
+unsigned arc_nr_processors(void);
+bool arc_game_specific_metadata(struct arc_metadata *meta);
+extern const uint8_t arc_doukyuusei_2_dl_sbox[256];
+
+// src/arc/index.c
+struct arc_index_entry {
+	uint32_t offset;
+	uint32_t raw_size;
+	string name;
+	struct awd_file_metadata meta;
+};
+
+static inline const char *arc_index_name(struct archive *arc, unsigned i)
+{
+	struct arc_private *p = arc_priv(arc);
+	return p->index.names + p->index.name_off[i];
+}
+
+void arc_index_init(struct archive *arc);
+void arc_index_set(struct archive *arc, unsigned i, struct arc_index_entry *e);
+void arc_index_finish(struct archive *arc);
+void arc_index_free(struct archive *arc);
+void arc_name_table_build(struct archive *arc);
+int arc_name_table_lookup(struct archive *arc, const char *name);
+unsigned arc_name_dedup(const char **names, uint32_t *values, unsigned n);
+void arc_name_table_build_keys(struct arc_name_table *t, const char **names,
+		const uint32_t *values, unsigned nr_keys);
+bool arc_name_table_probe(const struct arc_name_table *t, const char *name, uint32_t *value);
+void arc_name_table_free(struct arc_name_table *t);
+bool arc_name_equal(const char *name, const char *upname);
+bool arc_sidecar_load(struct archive *arc, const char *path, FILE *fp);
+void arc_sidecar_save(struct archive *arc, const char *path, FILE *fp);
+void arc_sidecar_close(struct archive *arc);
+
+// src/arc/stream.c
+bool arc_checkpoints_complete(struct archive_data *data);
+uint8_t *arc_lzss_decompress_checkpoints(struct archive_data *data, const uint8_t *in,
+		size_t in_size, size_t *out_size);
+
+#endif // AI5_ARC_INTERNAL_H
@@ -0,0 +1,347 @@
+/* Copyright (C) 2023 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "nulib.h"
+#include "nulib/little_endian.h"
+#include "ai5/arc.h"
+#include "ai5/awd.h"
+#include "arc_internal.h"
+
+struct awd_stream {
+	struct archive *arc;
+	uint32_t offset;     // offset of PCM data in archive
+	uint32_t nr_frames;
+	uint32_t frame_size; // bytes per frame
+	uint32_t pos;        // current frame
+	uint32_t loop_start;
+	uint32_t loop_end;
+	unsigned channels;
+	bool loop;
+};
+
+struct awd_stream *awd_stream_open_by_index(struct archive *arc, unsigned i, bool loop)
+{
+	struct arc_private *p = arc_priv(arc);
+	if (i >= arc->meta.nr_files)
+		return NULL;
+	if ((arc->meta.type != ARCHIVE_TYPE_AWD && arc->meta.type != ARCHIVE_TYPE_AWF)
+			|| p->index.awd_type[i] != AWD_PCM) {
+		WARNING("Not a PCM entry: %s", arc_index_name(arc, i));
+		return NULL;
+	}
+
+	struct awd_stream *s = xcalloc(1, sizeof(struct awd_stream));
+	s->arc = arc;
+	s->offset = p->index.offset[i];
+	s->channels = (arc->flags & ARCHIVE_STEREO) ? 2 : 1;
+	s->frame_size = s->channels * 2;
+	s->nr_frames = p->index.raw_size[i] / s->frame_size;
+
+	s->loop_start = p->index.loop_start[i];
+	s->loop_end = p->index.loop_end[i];
+	if (!s->loop_end || s->loop_end > s->nr_frames)
+		s->loop_end = s->nr_frames;
+	s->loop = loop && s->loop_start < s->loop_end;
+	return s;
+}
+
+struct awd_stream *awd_stream_open(struct archive *arc, const char *name, bool loop)
+{
+	int i = archive_get_index(arc, name);
+	if (i < 0)
+		return NULL;
+	return awd_stream_open_by_index(arc, i, loop);
+}
+
+void awd_stream_close(struct awd_stream *s)
+{
+	free(s);
+}
+
+static bool awd_stream_copy(struct awd_stream *s, int16_t *out, uint32_t frames)
+{
+	const size_t size = (size_t)frames * s->frame_size;
+	const uint32_t off = s->offset + s->pos * s->frame_size;
+	if (arc_priv(s->arc)->mapped) {
+		memcpy(out, arc_priv(s->arc)->map.data + off, size);
+	} else if (!arc_read(s->arc, (uint8_t*)out, size, off)) {
+		return false;
+	}
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	for (size_t i = 0; i < frames * s->channels; i++) {
+		out[i] = le_get16((uint8_t*)out, i * 2);
+	}
+#endif
+	return true;
+}
+
+size_t awd_stream_read(struct awd_stream *s, int16_t *out, size_t frames)
+{
+	size_t done = 0;
+	while (done < frames) {
+		uint32_t end = s->loop ? s->loop_end : s->nr_frames;
+		if (s->pos >= end) {
+			if (!s->loop)
+				break;
+			s->pos = s->loop_start;
+			continue;
+		}
+		uint32_t n = min(frames - done, end - s->pos);
+		if (!awd_stream_copy(s, out + done * s->channels, n))
+			break;
+		s->pos += n;
+		done += n;
+	}
+	return done;
+}
+
+bool awd_stream_seek(struct awd_stream *s, uint32_t frame)
+{
+	if (frame > s->nr_frames)
+		return false;
+	s->pos = frame;
+	return true;
+}
+
+uint32_t awd_stream_tell(struct awd_stream *s)
+{
+	return s->pos;
+}
+
+unsigned awd_stream_channels(struct awd_stream *s)
+{
+	return s->channels;
+}
+
+uint32_t awd_stream_length(struct awd_stream *s)
+{
+	return s->nr_frames;
+}
+
+/*
+ * MP3 frame index.
+ */
+
+struct mp3_header {
+	uint8_t version; // 3 = MPEG 1, 2 = MPEG 2, 0 = MPEG 2.5
+	uint8_t layer;
+	bool crc;
+	uint16_t channels;
+	uint16_t samples;
+	uint32_t sample_rate;
+	uint32_t size;
+};
+
+static const uint16_t mp3_bitrates[2][3][15] = {
+	{ // MPEG 1
+		{ 0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448 },
+		{ 0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384 },
+		{ 0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320 },
+	},
+	{ // MPEG 2/2.5
+		{ 0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256 },
+		{ 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160 },
+		{ 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160 },
+	},
+};
+
+static const uint32_t mp3_sample_rates[3] = { 44100, 48000, 32000 };
+
+static bool mp3_parse_header(const uint8_t *p, struct mp3_header *h)
+{
+	if (p[0] != 0xff || (p[1] & 0xe0) != 0xe0)
+		return false;
+	unsigned version = (p[1] >> 3) & 3;
+	unsigned layer = 4 - ((p[1] >> 1) & 3);
+	unsigned br_i = p[2] >> 4;
+	unsigned sr_i = (p[2] >> 2) & 3;
+	// reserved values and free format
+	if (version == 1 || layer == 4 || br_i == 0 || br_i == 15 || sr_i == 3)
+		return false;
+
+	const bool mpeg1 = version == 3;
+	const uint32_t bitrate = mp3_bitrates[!mpeg1][layer-1][br_i] * 1000;
+	const unsigned pad = (p[2] >> 1) & 1;
+	h->version = version;
+	h->layer = layer;
+	h->crc = !(p[1] & 1);
+	h->channels = (p[3] >> 6) == 3 ? 1 : 2;
+	h->sample_rate = mp3_sample_rates[sr_i] >> (mpeg1 ? 0 : version == 2 ? 1 : 2);
+	if (layer == 1) {
+		h->samples = 384;
+		h->size = (12 * bitrate / h->sample_rate + pad) * 4;
+	} else if (layer == 2 || mpeg1) {
+		h->samples = 1152;
+		h->size = 144 * bitrate / h->sample_rate + pad;
+	} else {
+		h->samples = 576;
+		h->size = 72 * bitrate / h->sample_rate + pad;
+	}
+	return true;
+}
+
+/*
+ * Check for a Xing/Info (or VBRI) header, which occupies a frame that
+ * contains no audio.
+ */
+static bool mp3_is_info_frame(const uint8_t *p, const struct mp3_header *h)
+{
+	unsigned off = 4 + (h->crc ? 2 : 0);
+	if (h->version == 3)
+		off += h->channels == 1 ? 17 : 32;
+	else
+		off += h->channels == 1 ? 9 : 17;
+	if (off + 4 <= h->size && (!memcmp(p + off, "Xing", 4) || !memcmp(p + off, "Info", 4)))
+		return true;
+	return 36 + 4 <= h->size && !memcmp(p + 36, "VBRI", 4);
+}
+
+static struct awd_mp3_index *mp3_index_build(const uint8_t *data, uint32_t size)
+{
+	uint32_t pos = 0;
+
+	// skip ID3v2 tag(s)
+	while (size - pos >= 10 && !memcmp(data + pos, "ID3", 3)) {
+		const uint8_t *p = data + pos;
+		uint32_t tag_size = ((p[6] & 0x7f) << 21) | ((p[7] & 0x7f) << 14)
+			| ((p[8] & 0x7f) << 7) | (p[9] & 0x7f);
+		tag_size += (p[5] & 0x10) ? 20 : 10;
+		if (tag_size > size - pos)
+			break;
+		pos += tag_size;
+	}
+
+	struct mp3_header first = {0};
+	uint32_t nr_frames = 0;
+	uint32_t cap = 1024;
+	uint32_t *offsets = xmalloc(cap * sizeof(uint32_t));
+	uint32_t end = pos;
+	while (size - pos >= 4) {
+		struct mp3_header h;
+		if (!mp3_parse_header(data + pos, &h) || h.size > size - pos
+				|| (nr_frames && (h.version != first.version
+						|| h.layer != first.layer
+						|| h.sample_rate != first.sample_rate))) {
+			// resynchronize
+			pos++;
+			continue;
+		}
+		if (!nr_frames) {
+			first = h;
+			if (mp3_is_info_frame(data + pos, &h)) {
+				pos += h.size;
+				continue;
+			}
+		}
+		if (nr_frames == cap) {
+			cap *= 2;
+			offsets = xrealloc(offsets, cap * sizeof(uint32_t));
+		}
+		offsets[nr_frames++] = pos;
+		pos += h.size;
+		end = pos;
+	}
+
+	if (!nr_frames) {
+		free(offsets);
+		return NULL;
+	}
+
+	struct awd_mp3_index *idx = xmalloc(sizeof(struct awd_mp3_index)
+			+ (nr_frames + 1) * sizeof(uint32_t));
+	idx->sample_rate = first.sample_rate;
+	idx->channels = first.channels;
+	idx->samples_per_frame = first.samples;
+	idx->layer = first.layer;
+	idx->nr_frames = nr_frames;
+	memcpy(idx->frame_offset, offsets, nr_frames * sizeof(uint32_t));
+	idx->frame_offset[nr_frames] = end;
+	free(offsets);
+	return idx;
+}
+
+const struct awd_mp3_index *awd_mp3_index(struct archive *arc, unsigned i)
+{
+	struct arc_private *p = arc_priv(arc);
+	struct archive_data *data = archive_entry(arc, i);
+	if (!data)
+		return NULL;
+	struct arc_data_private *dp = arc_data_priv(data);
+	struct awd_mp3_index *idx = atomic_load_explicit(&dp->mp3, memory_order_acquire);
+	if (idx)
+		return idx;
+
+	if ((arc->meta.type != ARCHIVE_TYPE_AWD && arc->meta.type != ARCHIVE_TYPE_AWF)
+			|| p->index.awd_type[i] != AWD_MP3) {
+		WARNING("Not an MP3 entry: %s", data->name);
+		return NULL;
+	}
+
+	const uint32_t size = p->index.raw_size[i];
+	if (p->mapped) {
+		idx = mp3_index_build(p->map.data + p->index.offset[i], size);
+	} else {
+		uint8_t *buf = xmalloc(size);
+		if (!arc_read(arc, buf, size, p->index.offset[i])) {
+			free(buf);
+			return NULL;
+		}
+		idx = mp3_index_build(buf, size);
+		free(buf);
+	}
+	if (!idx) {
+		WARNING("No MP3 frames found: %s", data->name);
+		return NULL;
+	}
+
+	// another thread may have built the index in the meantime
+	struct awd_mp3_index *old = NULL;
+	if (!atomic_compare_exchange_strong_explicit(&dp->mp3, &old, idx,
+				memory_order_acq_rel, memory_order_acquire)) {
+		free(idx);
+		return old;
+	}
+	return idx;
+}
+
+// maximum size of the layer III bit reservoir (main_data_begin)
+#define MP3_MAX_RESERVOIR 511
+
+bool awd_mp3_seek(const struct awd_mp3_index *idx, uint32_t sample, struct awd_mp3_seek *out)
+{
+	uint32_t frame = sample / idx->samples_per_frame;
+	if (frame >= idx->nr_frames)
+		return false;
+
+	uint32_t start = frame;
+	if (idx->layer == 3 && start > 0) {
+		// the previous frame must be decoded correctly for the overlap,
+		// and it may use main data from the frames before it
+		start--;
+		uint32_t bytes = 0;
+		while (start > 0 && bytes < MP3_MAX_RESERVOIR) {
+			bytes += idx->frame_offset[start] - idx->frame_offset[start-1];
+			start--;
+		}
+	}
+
+	out->offset = idx->frame_offset[start];
+	out->frame = start;
+	out->skip = sample - start * idx->samples_per_frame;
+	return true;
+}
@@ -0,0 +1,777 @@
+/* Copyright (C) 2023 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#define mmap(...) (ERROR("mmap not supported on Windows"), NULL)
+#define munmap(...) (ERROR("munmap not supported on Windows"), -1)
+#define MAP_FAILED 0
+#else
+#include <sys/mman.h>
+#endif
+
+#include "nulib.h"
+#include "nulib/file.h"
+#include "nulib/little_endian.h"
+#include "nulib/string.h"
+#include "nulib/vector.h"
+#include "ai5/arc.h"
+#include "ai5/game.h"
+#include "arc_internal.h"
+
+/*
+ * ASCII upper case conversion. File names are stored and compared in upper
+ * case.
+ */
+static inline uint8_t name_fold(uint8_t c)
+{
+	return c >= 'a' && c <= 'z' ? c - ('a' - 'A') : c;
+}
+
+/*
+ * Packed index.
+ *
+ * The file index is stored as parallel arrays, with all names in a single
+ * string pool. A full `struct archive_data` handle is only created for an
+ * entry when it is first accessed.
+ */
+
+void arc_index_init(struct archive *arc)
+{
+	struct arc_private *p = arc_priv(arc);
+	const unsigned n = arc->meta.nr_files;
+	p->index.offset = xcalloc(n, sizeof(uint32_t));
+	p->index.raw_size = xcalloc(n, sizeof(uint32_t));
+	p->index.name_off = xcalloc(n, sizeof(uint32_t));
+	if (arc->meta.type == ARCHIVE_TYPE_AWD || arc->meta.type == ARCHIVE_TYPE_AWF) {
+		p->index.loop_start = xcalloc(n, sizeof(uint32_t));
+		p->index.loop_end = xcalloc(n, sizeof(uint32_t));
+		p->index.awd_type = xcalloc(n, sizeof(uint16_t));
+	}
+	p->index.names = NULL;
+	p->index.names_size = 0;
+	p->index.names_cap = 0;
+}
+
+void arc_index_set(struct archive *arc, unsigned i, struct arc_index_entry *e)
+{
+	struct arc_private *p = arc_priv(arc);
+	p->index.offset[i] = e->offset;
+	p->index.raw_size[i] = e->raw_size;
+	if (p->index.awd_type) {
+		p->index.loop_start[i] = e->meta.loop_start;
+		p->index.loop_end[i] = e->meta.loop_end;
+		p->index.awd_type[i] = e->meta.type;
+	}
+
+	// append upper case name to string pool
+	size_t len = strlen(e->name) + 1;
+	if (p->index.names_size + len > p->index.names_cap) {
+		p->index.names_cap = max(p->index.names_cap * 2,
+				p->index.names_size + len + 1024);
+		p->index.names = xrealloc(p->index.names, p->index.names_cap);
+	}
+	char *name = p->index.names + p->index.names_size;
+	for (size_t j = 0; j < len; j++) {
+		name[j] = name_fold(e->name[j]);
+	}
+	p->index.name_off[i] = p->index.names_size;
+	p->index.names_size += len;
+	string_free(e->name);
+	e->name = NULL;
+}
+
+void arc_index_finish(struct archive *arc)
+{
+	struct arc_private *p = arc_priv(arc);
+	arc_name_table_build(arc);
+	p->handles = xcalloc(arc->meta.nr_files, sizeof(*p->handles));
+}
+
+void arc_index_free(struct archive *arc)
+{
+	struct arc_private *p = arc_priv(arc);
+	if (p->handles) {
+		for (unsigned i = 0; i < arc->meta.nr_files; i++) {
+			struct archive_data *data = atomic_load(&p->handles[i]);
+			if (!data)
+				continue;
+			struct arc_data_private *dp = arc_data_priv(data);
+			string_free(data->name);
+			free(atomic_load(&dp->mp3));
+			free(dp->checkpoints);
+			free(dp);
+		}
+		free(p->handles);
+		p->handles = NULL;
+	}
+	if (!p->sidecar.data) {
+		free(p->index.offset);
+		free(p->index.raw_size);
+		free(p->index.name_off);
+		free(p->index.loop_start);
+		free(p->index.loop_end);
+		free(p->index.awd_type);
+		free(p->index.names);
+		free(p->index.table.disp);
+		free(p->index.table.slots);
+	}
+	memset(&p->index, 0, sizeof(p->index));
+}
+
+const char *archive_entry_name(struct archive *arc, unsigned i)
+{
+	if (i >= arc->meta.nr_files)
+		return NULL;
+	return arc_index_name(arc, i);
+}
+
+struct archive_data *archive_entry(struct archive *arc, unsigned i)
+{
+	struct arc_private *p = arc_priv(arc);
+	if (i >= arc->meta.nr_files)
+		return NULL;
+
+	struct archive_data *data = atomic_load_explicit(&p->handles[i],
+			memory_order_acquire);
+	if (data)
+		return data;
+
+	struct arc_data_private *new_priv = xcalloc(1, sizeof(struct arc_data_private));
+	struct archive_data *new = &new_priv->pub;
+	new->offset = p->index.offset[i];
+	new->raw_size = p->index.raw_size[i];
+	new->name = string_new(arc_index_name(arc, i));
+	if (p->index.awd_type) {
+		new->meta.type = p->index.awd_type[i];
+		new->meta.loop_start = p->index.loop_start[i];
+		new->meta.loop_end = p->index.loop_end[i];
+	}
+	new_priv->index = i;
+	new->archive = arc;
+
+	// another thread may have created the handle in the meantime
+	if (!atomic_compare_exchange_strong_explicit(&p->handles[i], &data, new,
+				memory_order_acq_rel, memory_order_acquire)) {
+		string_free(new->name);
+		free(new_priv);
+		return data;
+	}
+	return new;
+}
+
+/*
+ * Name table.
+ *
+ * Minimal perfect hash (hash and displace) mapping file names to entry
+ * indices. Names are hashed with ASCII case folding applied on the fly, so
+ * lookups need neither a copy of the name nor a length limit.
+ *
+ * Keys are distributed into buckets of about 2 by the upper half of their
+ * hash. Buckets are placed largest first: for each one we search for a
+ * displacement value which maps all of its keys to free slots. Single-key
+ * buckets store the slot directly. A lookup costs one hash, one table
+ * probe and one string compare.
+ */
+
+#define NAME_BUCKET_SIZE 2
+#define NAME_DIRECT 0x80000000u
+#define NAME_MAX_BUCKET 32
+#define NAME_MAX_DISPLACEMENT (1u << 20)
+
+static uint64_t name_hash(const char *name, uint32_t seed)
+{
+	// FNV-1a with case folding, followed by a finalizer so that both
+	// halves of the hash are usable
+	uint64_t h = 0xcbf29ce484222325ull ^ seed;
+	for (int i = 0; name[i]; i++) {
+		h = (h ^ name_fold(name[i])) * 0x100000001b3ull;
+	}
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdull;
+	h ^= h >> 33;
+	return h;
+}
+
+static inline uint32_t name_bucket(uint64_t h, uint32_t nr_buckets)
+{
+	return ((h >> 32) * nr_buckets) >> 32;
+}
+
+static inline uint32_t name_slot(uint64_t h, uint32_t d, uint32_t nr_slots)
+{
+	uint32_t x = (uint32_t)h ^ (d * 0x9e3779b9u);
+	x ^= x >> 16;
+	x *= 0x85ebca6bu;
+	x ^= x >> 13;
+	return ((uint64_t)x * nr_slots) >> 32;
+}
+
+bool arc_name_equal(const char *name, const char *upname)
+{
+	for (int i = 0; ; i++) {
+		if (name_fold(name[i]) != (uint8_t)upname[i])
+			return false;
+		if (!name[i])
+			return true;
+	}
+}
+
+/*
+ * Try to build the table with the given seed. Returns false if some bucket
+ * could not be placed.
+ */
+static bool name_table_try_build(struct arc_name_table *t, const char **names,
+		const uint32_t *values, unsigned nr_keys, uint32_t seed)
+{
+	const uint32_t nr_buckets = t->nr_buckets;
+	const uint32_t nr_slots = t->nr_slots;
+	uint64_t *hashes = xmalloc(nr_keys * sizeof(uint64_t));
+	uint32_t *keys = xmalloc(nr_keys * sizeof(uint32_t));
+	uint32_t *first = xcalloc(nr_buckets + 1, sizeof(uint32_t));
+	uint32_t *order = xcalloc(nr_buckets, sizeof(uint32_t));
+	bool *used = xcalloc(nr_slots, sizeof(bool));
+	unsigned size_start[NAME_MAX_BUCKET + 2] = {0};
+	uint32_t slot_buf[NAME_MAX_BUCKET];
+	bool ok = false;
+
+	// counting sort of keys by bucket
+	for (unsigned i = 0; i < nr_keys; i++) {
+		hashes[i] = name_hash(names[i], seed);
+		first[name_bucket(hashes[i], nr_buckets) + 1]++;
+	}
+	for (uint32_t b = 0; b < nr_buckets; b++) {
+		uint32_t size = first[b + 1];
+		if (size > NAME_MAX_BUCKET)
+			goto end;
+		size_start[size]++;
+		first[b + 1] += first[b];
+	}
+	for (unsigned i = 0; i < nr_keys; i++) {
+		uint32_t b = name_bucket(hashes[i], nr_buckets);
+		// `order` is used as a fill cursor here
+		keys[first[b] + order[b]++] = i;
+	}
+
+	// order buckets by size (largest first), by counting sort
+	unsigned pos = 0;
+	for (int size = NAME_MAX_BUCKET; size >= 0; size--) {
+		unsigned n = size_start[size];
+		size_start[size] = pos;
+		pos += n;
+	}
+	for (uint32_t b = 0; b < nr_buckets; b++) {
+		order[size_start[first[b + 1] - first[b]]++] = b;
+	}
+
+	uint32_t free_slot = 0;
+	for (uint32_t bi = 0; bi < nr_buckets; bi++) {
+		const uint32_t b = order[bi];
+		const uint32_t *k = keys + first[b];
+		const uint32_t size = first[b + 1] - first[b];
+		if (size == 0)
+			break;
+		if (size == 1) {
+			while (used[free_slot])
+				free_slot++;
+			used[free_slot] = true;
+			t->disp[b] = NAME_DIRECT | free_slot;
+			t->slots[free_slot] = values[k[0]];
+			continue;
+		}
+		uint32_t d;
+		for (d = 0; d < NAME_MAX_DISPLACEMENT; d++) {
+			unsigned j;
+			for (j = 0; j < size; j++) {
+				uint32_t slot = name_slot(hashes[k[j]], d, nr_slots);
+				if (used[slot])
+					break;
+				used[slot] = true;
+				slot_buf[j] = slot;
+			}
+			if (j == size)
+				break;
+			// undo partial placement
+			while (j-- > 0)
+				used[slot_buf[j]] = false;
+		}
+		if (d == NAME_MAX_DISPLACEMENT)
+			goto end;
+		t->disp[b] = d;
+		for (unsigned j = 0; j < size; j++) {
+			t->slots[slot_buf[j]] = values[k[j]];
+		}
+	}
+	ok = true;
+end:
+	free(used);
+	free(order);
+	free(first);
+	free(keys);
+	free(hashes);
+	return ok;
+}
+
+/*
+ * Remove duplicate names (which must be upper case) from parallel arrays
+ * of names and values. The first occurrence of a name wins. Returns the new
+ * number of names.
+ */
+unsigned arc_name_dedup(const char **names, uint32_t *values, unsigned n)
+{
+	unsigned nr_keys = 0;
+	uint32_t dedup_size = 16;
+	while (dedup_size < n * 2)
+		dedup_size <<= 1;
+	const uint32_t dedup_mask = dedup_size - 1;
+	uint32_t *dedup = xcalloc(dedup_size, sizeof(uint32_t));
+	for (unsigned i = 0; i < n; i++) {
+		const char *name = names[i];
+		uint32_t slot = name_hash(name, 0) & dedup_mask;
+		while (dedup[slot]) {
+			if (!strcmp(names[dedup[slot] - 1], name))
+				goto next;
+			slot = (slot + 1) & dedup_mask;
+		}
+		names[nr_keys] = name;
+		values[nr_keys] = values[i];
+		nr_keys++;
+		dedup[slot] = nr_keys;
+next:
+		continue;
+	}
+	free(dedup);
+	return nr_keys;
+}
+
+/*
+ * Build a table from unique names.
+ */
+void arc_name_table_build_keys(struct arc_name_table *t, const char **names,
+		const uint32_t *values, unsigned nr_keys)
+{
+	t->nr_slots = nr_keys;
+	t->nr_buckets = max((nr_keys + NAME_BUCKET_SIZE - 1) / NAME_BUCKET_SIZE, 1);
+	t->slots = xcalloc(max(nr_keys, 1), sizeof(uint32_t));
+	t->disp = xcalloc(t->nr_buckets, sizeof(uint32_t));
+	for (uint32_t seed = 0; ; seed++) {
+		if (!nr_keys || name_table_try_build(t, names, values, nr_keys, seed)) {
+			t->seed = seed;
+			break;
+		}
+	}
+}
+
+/*
+ * Get the value stored for the slot `name` hashes to. The caller must
+ * check that the name matches.
+ */
+bool arc_name_table_probe(const struct arc_name_table *t, const char *name, uint32_t *value)
+{
+	if (!t->nr_slots)
+		return false;
+	uint64_t h = name_hash(name, t->seed);
+	uint32_t d = t->disp[name_bucket(h, t->nr_buckets)];
+	uint32_t slot = (d & NAME_DIRECT) ? d & ~NAME_DIRECT : name_slot(h, d, t->nr_slots);
+	*value = t->slots[slot];
+	return true;
+}
+
+void arc_name_table_free(struct arc_name_table *t)
+{
+	free(t->disp);
+	free(t->slots);
+	memset(t, 0, sizeof(struct arc_name_table));
+}
+
+void arc_name_table_build(struct archive *arc)
+{
+	const unsigned nr_files = arc->meta.nr_files;
+	const char **names = xmalloc(max(nr_files, 1) * sizeof(const char*));
+	uint32_t *values = xmalloc(max(nr_files, 1) * sizeof(uint32_t));
+	for (unsigned i = 0; i < nr_files; i++) {
+		names[i] = arc_index_name(arc, i);
+		values[i] = i;
+	}
+
+	// drop duplicate names (the first entry wins)
+	unsigned nr_keys = arc_name_dedup(names, values, nr_files);
+	if (nr_keys != nr_files)
+		WARNING("skipping %u duplicate file names in archive", nr_files - nr_keys);
+
+	arc_name_table_build_keys(&arc_priv(arc)->index.table, names, values, nr_keys);
+	free(values);
+	free(names);
+}
+
+int arc_name_table_lookup(struct archive *arc, const char *name)
+{
+	uint32_t i;
+	if (!arc_name_table_probe(&arc_priv(arc)->index.table, name, &i))
+		return -1;
+	if (!arc_name_equal(name, arc_index_name(arc, i)))
+		return -1;
+	return i;
+}
+/*
+ * Index sidecar.
+ *
+ * The sidecar file (<archive>.idx) caches the result of metadata detection
+ * and index decryption, so that opening the archive again does not need to
+ * repeat that work. It is validated against the size and mtime of the
+ * archive and a hash of its first few kilobytes.
+ *
+ * The header is little endian. The arrays that follow it are stored in host
+ * byte order so that the packed index can be used in place; a sidecar
+ * written on a host with different byte order is ignored.
+ *
+ *   0x00 "AIDX"
+ *   0x04 version
+ *   0x08 archive size (64-bit)
+ *   0x10 archive mtime (64-bit)
+ *   0x18 hash of the start of the archive
+ *   0x1c game id
+ *   0x20 number of files
+ *   0x24 size of name pool (padded to a multiple of 4)
+ *   0x28 number of name table slots
+ *   0x2c struct arc_metadata (13 32-bit fields)
+ *   0x60 byte order mark (host order)
+ *   0x64 number of name table buckets
+ *   0x68 name table seed
+ *   0x80 offset[nr_files]
+ *        raw_size[nr_files]
+ *        name_off[nr_files]
+ *        loop_start[nr_files]  (AWD/AWF only)
+ *        loop_end[nr_files]    (AWD/AWF only)
+ *        awd_type[nr_files]    (AWD/AWF only, 16-bit, padded to 4 bytes)
+ *        name pool (NUL-terminated, upper case names)
+ *        name table displacements[nr_buckets]
+ *        name table slots[nr_slots]
+ */
+
+#define SIDECAR_VERSION 3
+#define SIDECAR_HEADER_SIZE 0x80
+#define SIDECAR_HASH_SIZE 4096
+#define SIDECAR_BOM 0x01020304
+
+struct sidecar_header {
+	uint64_t arc_size;
+	uint64_t arc_mtime;
+	uint32_t arc_hash;
+};
+
+struct sidecar_layout {
+	size_t offset;
+	size_t raw_size;
+	size_t name_off;
+	size_t loop_start;
+	size_t loop_end;
+	size_t awd_type;
+	size_t names;
+	size_t disp;
+	size_t slots;
+	size_t size;
+};
+
+static void sidecar_layout(struct sidecar_layout *l, uint32_t nr_files, bool awd,
+		uint32_t names_size, uint32_t nr_buckets, uint32_t nr_slots)
+{
+	const size_t array_size = (size_t)nr_files * 4;
+	l->offset = SIDECAR_HEADER_SIZE;
+	l->raw_size = l->offset + array_size;
+	l->name_off = l->raw_size + array_size;
+	l->loop_start = l->name_off + array_size;
+	if (awd) {
+		l->loop_end = l->loop_start + array_size;
+		l->awd_type = l->loop_end + array_size;
+		l->names = l->awd_type + (((size_t)nr_files * 2 + 3) & ~(size_t)3);
+	} else {
+		l->loop_end = l->awd_type = l->names = l->loop_start;
+	}
+	l->disp = l->names + names_size;
+	l->slots = l->disp + (size_t)nr_buckets * 4;
+	l->size = l->slots + (size_t)nr_slots * 4;
+}
+
+static bool sidecar_get_header(FILE *fp, struct sidecar_header *out)
+{
+	// stat the open file, not the path: it may have been replaced since
+	struct stat s;
+	if (fstat(fileno(fp), &s))
+		return false;
+
+	uint8_t buf[SIDECAR_HASH_SIZE];
+	size_t len = min((uint64_t)s.st_size, SIDECAR_HASH_SIZE);
+	if (fseek(fp, 0, SEEK_SET) || fread(buf, len, 1, fp) != 1)
+		return false;
+
+	// FNV-1a
+	uint32_t h = 0x811c9dc5;
+	for (size_t i = 0; i < len; i++) {
+		h = (h ^ buf[i]) * 0x01000193;
+	}
+
+	out->arc_size = s.st_size;
+	out->arc_mtime = s.st_mtime;
+	out->arc_hash = h;
+	return true;
+}
+
+static string sidecar_path(const char *path)
+{
+	return string_concat_fmt(string_new(path), ".idx");
+}
+
+static void meta_write(uint8_t *b, const struct arc_metadata *meta)
+{
+	le_put32(b, 0x00, meta->index_off);
+	le_put32(b, 0x04, meta->entry_size);
+	le_put32(b, 0x08, meta->name_length);
+	le_put32(b, 0x0c, meta->offset_key);
+	le_put32(b, 0x10, meta->size_key);
+	le_put32(b, 0x14, meta->name_key);
+	le_put32(b, 0x18, meta->offset_off);
+	le_put32(b, 0x1c, meta->size_off);
+	le_put32(b, 0x20, meta->name_off);
+	le_put32(b, 0x24, meta->awd_type_off);
+	le_put32(b, 0x28, meta->loop_start_off);
+	le_put32(b, 0x2c, meta->loop_end_off);
+	le_put32(b, 0x30, meta->scheme | (meta->type << 16));
+}
+
+static void meta_read(const uint8_t *b, struct arc_metadata *meta)
+{
+	meta->index_off = le_get32(b, 0x00);
+	meta->entry_size = le_get32(b, 0x04);
+	meta->name_length = le_get32(b, 0x08);
+	meta->offset_key = le_get32(b, 0x0c);
+	meta->size_key = le_get32(b, 0x10);
+	meta->name_key = le_get32(b, 0x14);
+	meta->offset_off = le_get32(b, 0x18);
+	meta->size_off = le_get32(b, 0x1c);
+	meta->name_off = le_get32(b, 0x20);
+	meta->awd_type_off = le_get32(b, 0x24);
+	meta->loop_start_off = le_get32(b, 0x28);
+	meta->loop_end_off = le_get32(b, 0x2c);
+	meta->scheme = le_get32(b, 0x30) & 0xffff;
+	meta->type = le_get32(b, 0x30) >> 16;
+}
+
+static uint8_t *sidecar_map(const char *path, size_t *size_out)
+{
+	FILE *fp = file_open_utf8(path, "rb");
+	if (!fp)
+		return NULL;
+
+	uint8_t *data = NULL;
+	struct stat s;
+	if (fstat(fileno(fp), &s) || s.st_size < SIDECAR_HEADER_SIZE)
+		goto end;
+#ifdef _WIN32
+	data = xmalloc(s.st_size);
+	if (fread(data, s.st_size, 1, fp) != 1) {
+		free(data);
+		data = NULL;
+		goto end;
+	}
+#else
+	data = mmap(0, s.st_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+	if (data == MAP_FAILED) {
+		data = NULL;
+		goto end;
+	}
+#endif
+	*size_out = s.st_size;
+end:
+	fclose(fp);
+	return data;
+}
+
+static void sidecar_unmap(uint8_t *data, size_t size)
+{
+#ifdef _WIN32
+	free(data);
+#else
+	munmap(data, size);
+#endif
+}
+
+bool arc_sidecar_load(struct archive *arc, const char *path, FILE *fp)
+{
+	struct arc_private *p = arc_priv(arc);
+	struct sidecar_header hdr;
+	if (!sidecar_get_header(fp, &hdr))
+		return false;
+
+	string idx_path = sidecar_path(path);
+	size_t size;
+	uint8_t *data = sidecar_map(idx_path, &size);
+	string_free(idx_path);
+	if (!data)
+		return false;
+
+	// validate header
+	uint32_t bom;
+	memcpy(&bom, data + 0x60, 4);
+	if (memcmp(data, "AIDX", 4) || le_get32(data, 0x04) != SIDECAR_VERSION
+			|| bom != SIDECAR_BOM)
+		goto invalid;
+	if (le_get32(data, 0x08) != (uint32_t)hdr.arc_size
+			|| le_get32(data, 0x0c) != (uint32_t)(hdr.arc_size >> 32)
+			|| le_get32(data, 0x10) != (uint32_t)hdr.arc_mtime
+			|| le_get32(data, 0x14) != (uint32_t)(hdr.arc_mtime >> 32)
+			|| le_get32(data, 0x18) != hdr.arc_hash
+			|| le_get32(data, 0x1c) != (uint32_t)ai5_target_game)
+		goto invalid;
+
+	struct arc_metadata meta;
+	meta_read(data + 0x2c, &meta);
+	meta.arc_size = hdr.arc_size;
+	meta.nr_files = le_get32(data, 0x20);
+	uint32_t names_size = le_get32(data, 0x24);
+	uint32_t nr_slots = le_get32(data, 0x28);
+	uint32_t nr_buckets = le_get32(data, 0x64);
+	bool awd = meta.type == ARCHIVE_TYPE_AWD || meta.type == ARCHIVE_TYPE_AWF;
+
+	struct sidecar_layout l;
+	sidecar_layout(&l, meta.nr_files, awd, names_size, nr_buckets, nr_slots);
+	if (l.size != size || (names_size & 3) || !nr_buckets
+			|| nr_slots > meta.nr_files)
+		goto invalid;
+	if (names_size && data[l.disp - 1])
+		goto invalid;
+
+	// validate arrays, so that a damaged sidecar cannot cause out of bounds
+	// accesses later on
+	const uint32_t *offset = (uint32_t*)(data + l.offset);
+	const uint32_t *raw_size = (uint32_t*)(data + l.raw_size);
+	const uint32_t *name_off = (uint32_t*)(data + l.name_off);
+	const uint32_t *disp = (uint32_t*)(data + l.disp);
+	const uint32_t *slots = (uint32_t*)(data + l.slots);
+	for (uint32_t i = 0; i < meta.nr_files; i++) {
+		if (name_off[i] >= names_size)
+			goto invalid;
+		// entry data must lie within the archive
+		if (offset[i] > meta.arc_size || raw_size[i] > meta.arc_size - offset[i])
+			goto invalid;
+	}
+	for (uint32_t i = 0; i < nr_buckets; i++) {
+		if ((disp[i] & NAME_DIRECT) && (disp[i] & ~NAME_DIRECT) >= nr_slots)
+			goto invalid;
+	}
+	for (uint32_t i = 0; i < nr_slots; i++) {
+		if (slots[i] >= meta.nr_files)
+			goto invalid;
+	}
+
+	arc->meta = meta;
+	p->index.offset = (uint32_t*)(data + l.offset);
+	p->index.raw_size = (uint32_t*)(data + l.raw_size);
+	p->index.name_off = (uint32_t*)(data + l.name_off);
+	if (awd) {
+		p->index.loop_start = (uint32_t*)(data + l.loop_start);
+		p->index.loop_end = (uint32_t*)(data + l.loop_end);
+		p->index.awd_type = (uint16_t*)(data + l.awd_type);
+	}
+	p->index.names = (char*)(data + l.names);
+	p->index.names_size = names_size;
+	p->index.table.disp = (uint32_t*)(data + l.disp);
+	p->index.table.slots = (uint32_t*)(data + l.slots);
+	p->index.table.nr_buckets = nr_buckets;
+	p->index.table.nr_slots = nr_slots;
+	p->index.table.seed = le_get32(data, 0x68);
+	p->handles = xcalloc(meta.nr_files, sizeof(*p->handles));
+	p->sidecar.data = data;
+	p->sidecar.size = size;
+	return true;
+invalid:
+	sidecar_unmap(data, size);
+	return false;
+}
+
+void arc_sidecar_save(struct archive *arc, const char *path, FILE *fp)
+{
+	struct arc_private *p = arc_priv(arc);
+	struct sidecar_header hdr;
+	if (!sidecar_get_header(fp, &hdr))
+		return;
+
+	const uint32_t nr_files = arc->meta.nr_files;
+	const uint32_t names_size = (p->index.names_size + 3) & ~3;
+	struct sidecar_layout l;
+	sidecar_layout(&l, nr_files, p->index.awd_type, names_size,
+			p->index.table.nr_buckets, p->index.table.nr_slots);
+	uint8_t *data = xcalloc(1, l.size);
+
+	memcpy(data, "AIDX", 4);
+	le_put32(data, 0x04, SIDECAR_VERSION);
+	le_put32(data, 0x08, hdr.arc_size);
+	le_put32(data, 0x0c, hdr.arc_size >> 32);
+	le_put32(data, 0x10, hdr.arc_mtime);
+	le_put32(data, 0x14, hdr.arc_mtime >> 32);
+	le_put32(data, 0x18, hdr.arc_hash);
+	le_put32(data, 0x1c, ai5_target_game);
+	le_put32(data, 0x20, nr_files);
+	le_put32(data, 0x24, names_size);
+	le_put32(data, 0x28, p->index.table.nr_slots);
+	meta_write(data + 0x2c, &arc->meta);
+	uint32_t bom = SIDECAR_BOM;
+	memcpy(data + 0x60, &bom, 4);
+	le_put32(data, 0x64, p->index.table.nr_buckets);
+	le_put32(data, 0x68, p->index.table.seed);
+
+	memcpy(data + l.offset, p->index.offset, nr_files * 4);
+	memcpy(data + l.raw_size, p->index.raw_size, nr_files * 4);
+	memcpy(data + l.name_off, p->index.name_off, nr_files * 4);
+	if (p->index.awd_type) {
+		memcpy(data + l.loop_start, p->index.loop_start, nr_files * 4);
+		memcpy(data + l.loop_end, p->index.loop_end, nr_files * 4);
+		memcpy(data + l.awd_type, p->index.awd_type, nr_files * 2);
+	}
+	memcpy(data + l.names, p->index.names, p->index.names_size);
+	memcpy(data + l.disp, p->index.table.disp, p->index.table.nr_buckets * 4);
+	memcpy(data + l.slots, p->index.table.slots, p->index.table.nr_slots * 4);
+
+	// write to a temporary file and rename, so that a concurrent open never
+	// sees a partially written sidecar
+	string idx_path = sidecar_path(path);
+	string tmp_path = string_concat_fmt(string_new(idx_path), ".tmp");
+	FILE *out = file_open_utf8(tmp_path, "wb");
+	if (out) {
+		bool ok = fwrite(data, l.size, 1, out) == 1;
+		ok = !fclose(out) && ok;
+		if (!ok || rename(tmp_path, idx_path))
+			remove(tmp_path);
+	}
+	string_free(tmp_path);
+	string_free(idx_path);
+	free(data);
+}
+
+void arc_sidecar_close(struct archive *arc)
+{
+	struct arc_private *p = arc_priv(arc);
+	if (!p->sidecar.data)
+		return;
+	sidecar_unmap(p->sidecar.data, p->sidecar.size);
+	p->sidecar.data = NULL;
+	p->sidecar.size = 0;
+}
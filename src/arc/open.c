@@ -20,10 +20,12 @@
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <time.h>
 
 #ifdef _WIN32
 #define mmap(...) (ERROR("mmap not supported on Windows"), NULL)
 #define munmap(...) (ERROR("munmap not supported on Windows"), -1)
+#define madvise(...) 0
 #define MAP_FAILED 0
 #else
 #include <sys/mman.h>
@@ -31,7 +33,6 @@
 
 #include "nulib.h"
 #include "nulib/file.h"
-#include "nulib/hashtable.h"
 #include "nulib/little_endian.h"
 #include "nulib/string.h"
 #include "nulib/utfsjis.h"
@@ -39,11 +40,82 @@
 #include "ai5/arc.h"
 #include "ai5/lzss.h"
 #include "ai5/game.h"
+#include "arc_internal.h"
 
 #define MAX_SANE_FILES 100000
-#define DEFAULT_CACHE_SIZE 16
+#define DEFAULT_CACHE_LIMIT (32 * 1024 * 1024)
 
-define_hashtable_string(arcindex, int);
+
+/*
+ * Cache budget groups. Every archive belongs to exactly one group (the
+ * default group unless it was moved with `arc_set_cache_group`), and each
+ * group may have its own budget in addition to the process-wide one.
+ */
+struct arc_cache_group {
+	atomic_size_t limit;
+	atomic_size_t used;
+	TAILQ_HEAD(, arc_private) archives;
+	TAILQ_ENTRY(arc_cache_group) entry;
+};
+
+static struct arc_cache_group default_group = {
+	.archives = TAILQ_HEAD_INITIALIZER(default_group.archives),
+};
+
+/*
+ * Process-wide cache budget, shared by all open archives.
+ */
+static struct {
+	// protects group membership and eviction across archives
+	pthread_mutex_t lock;
+	atomic_size_t limit;
+	atomic_size_t used;
+	atomic_uint_fast64_t clock;
+	TAILQ_HEAD(, arc_cache_group) groups; // groups other than the default
+} global_cache = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.groups = TAILQ_HEAD_INITIALIZER(global_cache.groups),
+};
+
+static struct archive_counters global_stats;
+
+#define stats_add(arc, counter, n) do { \
+	atomic_fetch_add_explicit(&arc_priv((arc))->stats.counter, n, memory_order_relaxed); \
+	atomic_fetch_add_explicit(&global_stats.counter, n, memory_order_relaxed); \
+} while (0)
+
+static uint64_t stats_clock(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void counters_get(struct archive_counters *c, struct archive_stats *out)
+{
+	out->cache_hits = atomic_load(&c->cache_hits);
+	out->cache_misses = atomic_load(&c->cache_misses);
+	out->cache_evictions = atomic_load(&c->cache_evictions);
+	out->bytes_read = atomic_load(&c->bytes_read);
+	out->bytes_mapped = atomic_load(&c->bytes_mapped);
+	out->bytes_decompressed = atomic_load(&c->bytes_decompressed);
+	out->read_ns = atomic_load(&c->read_ns);
+	out->lzss_ns = atomic_load(&c->lzss_ns);
+	out->wav_ns = atomic_load(&c->wav_ns);
+}
+
+static void counters_reset(struct archive_counters *c)
+{
+	atomic_store(&c->cache_hits, 0);
+	atomic_store(&c->cache_misses, 0);
+	atomic_store(&c->cache_evictions, 0);
+	atomic_store(&c->bytes_read, 0);
+	atomic_store(&c->bytes_mapped, 0);
+	atomic_store(&c->bytes_decompressed, 0);
+	atomic_store(&c->read_ns, 0);
+	atomic_store(&c->lzss_ns, 0);
+	atomic_store(&c->wav_ns, 0);
+}
 
 static off_t get_file_size(FILE *fp)
 {
@@ -107,6 +179,33 @@ static bool arc_get_size_and_count(FILE *fp, struct arc_metadata *meta)
 	return true;
 }
 
+/*
+ * Set the index layout for games whose ARC archives use a game-specific
+ * cipher. Returns false if the target game uses the typical cipher.
+ */
+bool arc_game_specific_metadata(struct arc_metadata *meta)
+{
+	switch (ai5_target_game) {
+	case GAME_DOUKYUUSEI2_DL:
+		meta->entry_size = 39;
+		meta->name_length = 31;
+		break;
+	case GAME_KAKYUUSEI:
+		meta->entry_size = 20;
+		meta->name_length = 12;
+		break;
+	case GAME_KISAKU_ANIM:
+		meta->entry_size = 272;
+		meta->name_length = 260;
+		break;
+	default:
+		return false;
+	}
+	meta->index_off = 4;
+	meta->scheme = ARCHIVE_SCHEME_GAME_SPECIFIC;
+	return true;
+}
+
 static bool arc_get_metadata(FILE *fp, struct arc_metadata *meta_out)
 {
 	struct arc_metadata meta = {
@@ -118,27 +217,9 @@ static bool arc_get_metadata(FILE *fp, struct arc_metadata *meta_out)
 		return false;
 
 	// check for game-specific cipher
-	switch (ai5_target_game) {
-	case GAME_DOUKYUUSEI2_DL:
-		meta.entry_size = 39;
-		meta.name_length = 31;
-		meta.scheme = ARCHIVE_SCHEME_GAME_SPECIFIC;
-		*meta_out = meta;
-		return true;
-	case GAME_KAKYUUSEI:
-		meta.entry_size = 20;
-		meta.name_length = 12;
-		meta.scheme = ARCHIVE_SCHEME_GAME_SPECIFIC;
-		*meta_out = meta;
-		return true;
-	case GAME_KISAKU_ANIM:
-		meta.entry_size = 272;
-		meta.name_length = 260;
-		meta.scheme = ARCHIVE_SCHEME_GAME_SPECIFIC;
+	if (arc_game_specific_metadata(&meta)) {
 		*meta_out = meta;
 		return true;
-	default:
-		break;
 	}
 
 	// read (at least) 3 entries
@@ -311,29 +392,8 @@ static bool awf_get_metadata(FILE *fp, struct arc_metadata *meta_out)
 	return true;
 }
 
-static void create_index(struct archive *arc)
-{
-	for (int i = 0; i < vector_length(arc->files); i++) {
-		// upcase filename
-		char *name = vector_A(arc->files, i).name;
-		for (int i = 0; name[i]; i++) {
-			name[i] = toupper(name[i]);
-		}
-
-		int ret;
-		hashtable_iter_t k = hashtable_put(arcindex, &arc->index,
-				vector_A(arc->files, i).name,
-				&ret);
-		if (ret == HASHTABLE_KEY_PRESENT) {
-			WARNING("skipping duplicate file name in archive");
-			continue;
-		}
-		hashtable_val(&arc->index, k) = i;
-	}
-}
-
 static bool read_index(FILE *fp, struct archive *arc,
-		bool(*read_entry)(struct archive*,struct archive_data*,uint8_t*))
+		bool(*read_entry)(struct archive*,struct arc_index_entry*,uint8_t*))
 {
 	const size_t buf_len = arc->meta.nr_files * arc->meta.entry_size;
 	size_t buf_pos = 0;
@@ -345,27 +405,24 @@ static bool read_index(FILE *fp, struct archive *arc,
 	}
 
 	// read file entries
-	vector_init(arc->files);
-	vector_resize(struct archive_data, arc->files, arc->meta.nr_files);
+	arc_index_init(arc);
 	for (int i = 0; i < arc->meta.nr_files; i++, buf_pos += arc->meta.entry_size) {
-		struct archive_data *file = &vector_A(arc->files, i);
-		*file = (struct archive_data){0};
-		if (!read_entry(arc, file, buf + buf_pos)) {
+		struct arc_index_entry file = {0};
+		if (!read_entry(arc, &file, buf + buf_pos)) {
 			WARNING("Failed to read archive entry %d", i);
-			vector_destroy(arc->files);
-			vector_init(arc->files);
+			arc_index_free(arc);
 			free(buf);
 			return false;
 		}
-		file->archive = arc;
+		arc_index_set(arc, i, &file);
 	}
 
 	free(buf);
-	create_index(arc);
+	arc_index_finish(arc);
 	return true;
 }
 
-static bool typical_read_entry(struct archive *arc, struct archive_data *file, uint8_t *buf)
+static bool typical_read_entry(struct archive *arc, struct arc_index_entry *file, uint8_t *buf)
 {
 	const struct arc_metadata *meta = &arc->meta;
 
@@ -404,7 +461,7 @@ static bool typical_read_entry(struct archive *arc, struct archive_data *file, u
 	return true;
 }
 
-static uint8_t doukyuusei_2_dl_sbox[256] = {
+const uint8_t arc_doukyuusei_2_dl_sbox[256] = {
 	// 0
 	0x63, 0x93,  0xB, 0xCD, 0x51, 0x8A, 0x60, 0xC5,
 	0xB0, 0xF0, 0x26, 0xF6, 0xA5, 0x3D, 0x34, 0x9E,
@@ -447,13 +504,13 @@ static uint8_t doukyuusei_2_dl_sbox[256] = {
 	0xAE, 0x39, 0x7A,  0x8, 0xAC, 0x86, 0x37, 0xAA
 };
 
-static bool doukyuusei_2_dl_read_entry(struct archive *arc, struct archive_data *file,
+static bool doukyuusei_2_dl_read_entry(struct archive *arc, struct arc_index_entry *file,
 		uint8_t *entry)
 {
 	// decode entry
 	for (int i = 0; i < 39; i++) {
 		uint8_t sbox_i = (uint8_t)41 - entry[i];
-		entry[i] = doukyuusei_2_dl_sbox[sbox_i];
+		entry[i] = arc_doukyuusei_2_dl_sbox[sbox_i];
 	}
 	if (entry[38]) {
 		WARNING("name is not null-terminated");
@@ -485,24 +542,23 @@ static bool kakyuusei_read_index(FILE *fp, struct archive *arc)
 	// read file entries
 	uint8_t dec[20];
 	uint8_t key = arc->meta.nr_files;
-	vector_init(arc->files);
-	vector_resize(struct archive_data, arc->files, arc->meta.nr_files);
+	arc_index_init(arc);
 	for (int i = 0; i < arc->meta.nr_files; i++, buf_pos += 20) {
-		struct archive_data *file = &vector_A(arc->files, i);
-		*file = (struct archive_data){0};
 		for (int i = 0; i < 20; i++) {
 			dec[shuffle_table[i]] = buf[buf_pos + i] ^ key;
 			key = ((int)key * 3 + 1) & 0xff;
 		}
-		file->offset = le_get32(dec, 16);
-		file->raw_size = le_get32(dec, 12);
+		struct arc_index_entry file = {
+			.offset = le_get32(dec, 16),
+			.raw_size = le_get32(dec, 12),
+		};
 		dec[12] = '\0';
-		file->name = sjis_cstring_to_utf8((char*)dec, 0);
-		file->archive = arc;
+		file.name = sjis_cstring_to_utf8((char*)dec, 0);
+		arc_index_set(arc, i, &file);
 	}
 
 	free(buf);
-	create_index(arc);
+	arc_index_finish(arc);
 	return true;
 }
 
@@ -519,25 +575,23 @@ static bool kisaku_anim_read_index(FILE *fp, struct archive *arc)
 
 	// read file entries
 	uint8_t dec[260];
-	vector_init(arc->files);
-	vector_resize(struct archive_data, arc->files, arc->meta.nr_files);
+	arc_index_init(arc);
 	for (int i = 0; i < arc->meta.nr_files; i++, buf_pos += 272) {
 		int name_len = strnlen((char*)buf + buf_pos, 260);
 		for (int i = 0, key = name_len + 1; i < name_len; i++, key--) {
 			dec[i] = buf[buf_pos + i] - key;
 		}
 		dec[name_len] = '\0';
-		struct archive_data *file = &vector_A(arc->files, i);
-		*file = (struct archive_data) {
+		struct arc_index_entry file = {
 			.raw_size = be_get32(buf, buf_pos + 260),
 			.offset = be_get32(buf, buf_pos + 268),
 			.name = sjis_cstring_to_utf8((char*)dec, 0),
-			.archive = arc
 		};
+		arc_index_set(arc, i, &file);
 	}
 
 	free(buf);
-	create_index(arc);
+	arc_index_finish(arc);
 	return true;
 }
 
@@ -568,13 +622,23 @@ static bool arc_read_index(FILE *fp, struct archive *arc)
 struct archive *archive_open(const char *path, unsigned flags)
 {
 #ifdef _WIN32
-	flags &= ~ARCHIVE_MMAP;
+	flags &= ~(ARCHIVE_MMAP | ARCHIVE_PREAD);
+#else
+	// concurrent readers must not share a stream position
+	if ((flags & ARCHIVE_THREADSAFE) && !(flags & ARCHIVE_MMAP))
+		flags |= ARCHIVE_PREAD;
 #endif
 	FILE *fp = NULL;
-	struct archive *arc = xcalloc(1, sizeof(struct archive));
-	TAILQ_INIT(&arc->cache);
+	struct arc_private *p = xcalloc(1, sizeof(struct arc_private));
+	struct archive *arc = &p->pub;
+	TAILQ_INIT(&p->cache);
+	TAILQ_INIT(&p->probation);
 	if (flags & ARCHIVE_CACHE)
-		arc->cache_size = DEFAULT_CACHE_SIZE;
+		p->cache_limit = DEFAULT_CACHE_LIMIT;
+	if (flags & ARCHIVE_THREADSAFE) {
+		pthread_mutex_init(&p->lock, NULL);
+		pthread_cond_init(&p->load_cond, NULL);
+	}
 
 	// open archive file
 	if (!(fp = file_open_utf8(path, "rb"))) {
@@ -582,6 +646,15 @@ struct archive *archive_open(const char *path, unsigned flags)
 		goto error;
 	}
 
+	// warm open: metadata and index from sidecar
+	if ((flags & ARCHIVE_INDEX_SIDECAR) && arc_sidecar_load(arc, path, fp)) {
+		if (fseek(fp, 0, SEEK_SET)) {
+			WARNING("fseek: %s", strerror(errno));
+			goto error;
+		}
+		goto index_ok;
+	}
+
 	bool meta_ok;
 	const char *ext = file_extension(path);
 	if (!strcasecmp(ext, "dat")) {
@@ -599,6 +672,9 @@ struct archive *archive_open(const char *path, unsigned flags)
 	}
 	if (!arc_read_index(fp, arc))
 		goto error;
+	if (flags & ARCHIVE_INDEX_SIDECAR)
+		arc_sidecar_save(arc, path, fp);
+index_ok:
 
 	// store either mmap ptr/size or FILE* depending on flags
 	if (flags & ARCHIVE_MMAP) {
@@ -607,51 +683,129 @@ struct archive *archive_open(const char *path, unsigned flags)
 			WARNING("fileno: %s", strerror(errno));
 			goto error;
 		}
-		arc->map.data = mmap(0, arc->meta.arc_size, PROT_READ, MAP_SHARED, fd, 0);
-		arc->map.size = arc->meta.arc_size;
-		if (arc->map.data == MAP_FAILED) {
+		int map_flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+		if (flags & ARCHIVE_POPULATE)
+			map_flags |= MAP_POPULATE;
+#endif
+		p->map.data = mmap(0, arc->meta.arc_size, PROT_READ, map_flags, fd, 0);
+		p->map.size = arc->meta.arc_size;
+		if (p->map.data == MAP_FAILED) {
 			WARNING("mmap: %s", strerror(errno));
 			goto error;
 		}
+#ifdef MADV_HUGEPAGE
+		// only honored for some filesystems; failure is harmless
+		if (flags & ARCHIVE_HUGEPAGE)
+			madvise(p->map.data, p->map.size, MADV_HUGEPAGE);
+#endif
 		if (fclose(fp)) {
 			WARNING("fclose: %s", strerror(errno));
 			goto error;
 		}
-		arc->mapped = true;
+		p->mapped = true;
+	} else if (flags & ARCHIVE_PREAD) {
+		if ((p->fd = dup(fileno(fp))) < 0) {
+			WARNING("dup: %s", strerror(errno));
+			goto error;
+		}
+		if (fclose(fp))
+			WARNING("fclose: %s", strerror(errno));
+		p->use_pread = true;
 	} else {
-		arc->fp = fp;
+		p->fp = fp;
 	}
 
 	arc->flags = flags;
+	pthread_mutex_lock(&global_cache.lock);
+	p->group = &default_group;
+	TAILQ_INSERT_TAIL(&default_group.archives, p, budget_entry);
+	pthread_mutex_unlock(&global_cache.lock);
+	if (flags & ARCHIVE_SEQUENTIAL)
+		archive_advise(arc, ARCHIVE_ACCESS_SEQUENTIAL);
+	else if (flags & ARCHIVE_RANDOM)
+		archive_advise(arc, ARCHIVE_ACCESS_RANDOM);
 	return arc;
 error:
-	vector_destroy(arc->files);
-	free(arc);
+	arc_index_free(arc);
+	arc_sidecar_close(arc);
+	if (flags & ARCHIVE_THREADSAFE) {
+		pthread_mutex_destroy(&p->lock);
+		pthread_cond_destroy(&p->load_cond);
+	}
+	free(p);
 	if (fp && fclose(fp))
 		WARNING("fclose: %s", strerror(errno));
 	return NULL;
 }
 
-void archive_close(struct archive *arc)
+void arc_lock(struct archive *arc)
 {
-	if (arc->mapped) {
-		if (munmap(arc->map.data, arc->map.size))
-			WARNING("munmap: %s", strerror(errno));
-	} else {
-		if (fclose(arc->fp))
-			WARNING("fclose: %s", strerror(errno));
+	if (arc && (arc->flags & ARCHIVE_THREADSAFE))
+		pthread_mutex_lock(&arc_priv(arc)->lock);
+}
+
+void arc_unlock(struct archive *arc)
+{
+	if (arc && (arc->flags & ARCHIVE_THREADSAFE))
+		pthread_mutex_unlock(&arc_priv(arc)->lock);
+}
+
+static bool _archive_read(struct archive *arc, uint8_t *buf, size_t size, off_t off)
+{
+	struct arc_private *p = arc_priv(arc);
+#ifndef _WIN32
+	if (p->use_pread) {
+		while (size > 0) {
+			ssize_t r = pread(p->fd, buf, size, off);
+			if (r < 0) {
+				if (errno == EINTR)
+					continue;
+				WARNING("pread: %s", strerror(errno));
+				return false;
+			}
+			if (r == 0) {
+				WARNING("pread: unexpected end of file");
+				return false;
+			}
+			buf += r;
+			size -= r;
+			off += r;
+		}
+		return true;
+	}
+#endif
+	// stream position is shared: serialize seek+read
+	arc_lock(arc);
+	if (fseek(p->fp, off, SEEK_SET)) {
+		WARNING("fseek: %s", strerror(errno));
+		arc_unlock(arc);
+		return false;
 	}
-	for (unsigned i = 0; i < vector_length(arc->files); i++) {
-		string_free(vector_A(arc->files, i).name);
+	if (fread(buf, size, 1, p->fp) != 1) {
+		WARNING("fread: %s", strerror(errno));
+		arc_unlock(arc);
+		return false;
 	}
-	vector_destroy(arc->files);
-	hashtable_destroy(arcindex, &arc->index);
-	free(arc);
+	arc_unlock(arc);
+	return true;
 }
 
-static uint8_t *pack_wav(uint8_t *data_in, size_t size_in, size_t *size_out, bool stereo)
+/*
+ * Read `size` bytes at offset `off` in the archive file into `buf`.
+ */
+bool arc_read(struct archive *arc, uint8_t *buf, size_t size, off_t off)
+{
+	uint64_t start = stats_clock();
+	if (!_archive_read(arc, buf, size, off))
+		return false;
+	stats_add(arc, read_ns, stats_clock() - start);
+	stats_add(arc, bytes_read, size);
+	return true;
+}
+
+void arc_write_wav_header(uint8_t *data, size_t size_in, bool stereo)
 {
-	uint8_t *data = xmalloc(size_in + 44);
 	// master RIFF chunk
 	memcpy(data, "RIFF", 4);
 	le_put32(data, 4, size_in + 36);
@@ -675,157 +829,1256 @@ static uint8_t *pack_wav(uint8_t *data_in, size_t size_in, size_t *size_out, boo
 	// chunk containing the sampled data
 	memcpy(data + 36, "data", 4);
 	le_put32(data, 40, size_in);
+}
+
+static uint8_t *pack_wav(uint8_t *data_in, size_t size_in, size_t *size_out, bool stereo)
+{
+	uint8_t *data = xmalloc(size_in + 44);
+	arc_write_wav_header(data, size_in, stereo);
 	memcpy(data + 44, data_in, size_in);
 	*size_out = size_in + 44;
 	return data;
 }
 
+static bool data_is_pcm(struct archive_data *file)
+{
+	return (file->archive->meta.type == ARCHIVE_TYPE_AWD
+			|| file->archive->meta.type == ARCHIVE_TYPE_AWF)
+		&& file->meta.type == AWD_PCM;
+}
+
+static int archive_fd(struct archive *arc)
+{
+	struct arc_private *p = arc_priv(arc);
+	return p->use_pread ? p->fd : fileno(p->fp);
+}
+
+void archive_advise(struct archive *arc, enum archive_access access)
+{
+	struct arc_private *p = arc_priv(arc);
+	if (p->mapped) {
+#ifdef MADV_NORMAL
+		int advice = MADV_NORMAL;
+		if (access == ARCHIVE_ACCESS_SEQUENTIAL)
+			advice = MADV_SEQUENTIAL;
+		else if (access == ARCHIVE_ACCESS_RANDOM)
+			advice = MADV_RANDOM;
+		if (madvise(p->map.data, p->map.size, advice))
+			WARNING("madvise: %s", strerror(errno));
+#endif
+	} else {
+#ifdef POSIX_FADV_NORMAL
+		int advice = POSIX_FADV_NORMAL;
+		if (access == ARCHIVE_ACCESS_SEQUENTIAL)
+			advice = POSIX_FADV_SEQUENTIAL;
+		else if (access == ARCHIVE_ACCESS_RANDOM)
+			advice = POSIX_FADV_RANDOM;
+		posix_fadvise(archive_fd(arc), 0, 0, advice);
+#endif
+	}
+}
+
 /*
- * Decompress compressed file types.
+ * Ask the kernel to start reading a byte range of the archive.
  */
-static bool data_decompress(struct archive_data *file)
+static void prefetch_range(struct archive *arc, uint32_t off, uint32_t size)
 {
-	uint8_t *data;
-	size_t data_size;
+	struct arc_private *p = arc_priv(arc);
+	if (!size)
+		return;
+	if (p->mapped) {
+#ifdef MADV_WILLNEED
+		const uintptr_t page_mask = sysconf(_SC_PAGESIZE) - 1;
+		uintptr_t start = (uintptr_t)(p->map.data + off) & ~page_mask;
+		uintptr_t end = (uintptr_t)(p->map.data + off + size);
+		madvise((void*)start, end - start, MADV_WILLNEED);
+#endif
+	} else {
+#ifdef POSIX_FADV_WILLNEED
+		posix_fadvise(archive_fd(arc), off, size, POSIX_FADV_WILLNEED);
+#endif
+	}
+}
+
+void archive_prefetch_by_index(struct archive *arc, unsigned i)
+{
+	struct arc_private *p = arc_priv(arc);
+	if (i >= arc->meta.nr_files)
+		return;
+	prefetch_range(arc, p->index.offset[i], p->index.raw_size[i]);
+}
+
+bool archive_prefetch(struct archive *arc, const char *name)
+{
+	int i = archive_get_index(arc, name);
+	if (i < 0)
+		return false;
+	archive_prefetch_by_index(arc, i);
+	return true;
+}
+
+/*
+ * Decompress compressed file types. `data` is consumed (unless it points into
+ * a mapped region) and the decompressed data is returned.
+ */
+static uint8_t *data_decompress(struct archive_data *file, uint8_t *data, size_t *size,
+		bool *mapped)
+{
+	struct archive *arc = file->archive;
+	uint8_t *out;
+	size_t out_size;
+	uint64_t start = stats_clock();
 
 	if (file->archive->meta.type == ARCHIVE_TYPE_AWD
 			|| file->archive->meta.type == ARCHIVE_TYPE_AWF) {
 		if (file->meta.type == AWD_PCM) {
 			// raw s16le PCM data: convert to WAV
 			bool stereo = file->archive->flags & ARCHIVE_STEREO;
-			data = pack_wav(file->data, file->raw_size, &data_size, stereo);
+			out = pack_wav(data, *size, &out_size, stereo);
+			stats_add(arc, wav_ns, stats_clock() - start);
 		} else {
 			// mp3: do nothing
 			if (file->meta.type != AWD_MP3)
 				WARNING("Unknown AWD file type: %u", file->meta.type);
-			return true;
+			return data;
 		}
 	} else if (file->archive->flags & ARCHIVE_RAW) {
-		return true;
-	} else if (game_is_aiwin()) {
-		// LZSS compressed (bitwise): decompress
-		data = lzss_bw_decompress(file->data, file->raw_size, &data_size);
+		return data;
 	} else {
-		// LZSS compressed: decompress
-		data = lzss_decompress(file->data, file->raw_size, &data_size);
+		if ((arc->flags & ARCHIVE_LZSS_CHECKPOINTS) && !arc_checkpoints_complete(file)) {
+			// LZSS compressed: decompress, recording checkpoints
+			out = arc_lzss_decompress_checkpoints(file, data, *size, &out_size);
+		} else if (game_is_aiwin()) {
+			// LZSS compressed (bitwise): decompress
+			out = lzss_bw_decompress(data, *size, &out_size);
+		} else {
+			// LZSS compressed: decompress
+			out = lzss_decompress(data, *size, &out_size);
+		}
+		stats_add(arc, lzss_ns, stats_clock() - start);
+		if (out)
+			stats_add(arc, bytes_decompressed, out_size);
 	}
 
-	if (!file->mapped)
-		free(file->data);
-	file->mapped = false;
-	if (!data) {
+	if (!*mapped)
+		free(data);
+	*mapped = false;
+	if (!out) {
 		WARNING("lzss_decompress failed");
-		file->data = NULL;
-		file->size = 0;
-		return false;
+		return NULL;
 	}
-	file->data = data;
-	file->size = data_size;
-	return true;
+	*size = out_size;
+	return out;
+}
+
+/*
+ * Read and decompress the data for an entry. This function does not modify
+ * the entry and may be called without holding the archive lock.
+ */
+static uint8_t *data_read(struct archive_data *file, size_t *size_out, bool *mapped_out)
+{
+	struct archive *arc = file->archive;
+	struct arc_private *p = arc_priv(arc);
+	uint8_t *data;
+	size_t size = file->raw_size;
+	bool mapped;
+
+	if (p->mapped) {
+		data = p->map.data + file->offset;
+		mapped = true;
+		stats_add(arc, bytes_mapped, file->raw_size);
+	} else if (data_is_pcm(file)) {
+		// read PCM data directly after the WAV header
+		data = xmalloc(file->raw_size + 44);
+		if (!arc_read(arc, data + 44, file->raw_size, file->offset)) {
+			free(data);
+			return NULL;
+		}
+		arc_write_wav_header(data, file->raw_size, arc->flags & ARCHIVE_STEREO);
+		*size_out = file->raw_size + 44;
+		*mapped_out = false;
+		return data;
+	} else {
+		data = xmalloc(file->raw_size);
+		if (!arc_read(arc, data, file->raw_size, file->offset)) {
+			free(data);
+			return NULL;
+		}
+		mapped = false;
+	}
+
+	if (!(data = data_decompress(file, data, &size, &mapped)))
+		return NULL;
+	*size_out = size;
+	*mapped_out = mapped;
+	return data;
+}
+
+/*
+ * Drop a reference with the archive lock held.
+ */
+static void data_release_locked(struct archive_data *data)
+{
+	struct arc_data_private *dp = arc_data_priv(data);
+	if (dp->ref == 0)
+		ERROR("double-free of archive data");
+	if (--dp->ref == 0) {
+		if (!dp->mapped)
+			free(data->data);
+		data->data = NULL;
+		data->size = 0;
+		if (dp->allocated)
+			free(dp);
+	}
+}
+
+/*
+ * The number of bytes an entry costs while it is held by the cache. Data
+ * that points into a mapped region costs nothing.
+ */
+static size_t cache_cost(struct archive_data *data)
+{
+	return arc_data_priv(data)->mapped ? 0 : data->size;
+}
+
+/*
+ * Choose the next entry to evict. Under 2Q, entries in the probationary
+ * queue are evicted first as long as it holds more than its share of the
+ * budget.
+ */
+static struct archive_data *cache_victim(struct archive *arc)
+{
+	struct arc_private *p = arc_priv(arc);
+	struct arc_data_private *probation = TAILQ_LAST(&p->probation, cache_head);
+	struct arc_data_private *lru = TAILQ_LAST(&p->cache, cache_head);
+	if (probation && (!lru || p->probation_used > p->cache_limit / 4))
+		return &probation->pub;
+	return lru ? &lru->pub : NULL;
+}
+
+/*
+ * Remember an entry evicted from the probationary queue, so that it is
+ * admitted to the main queue if it is loaded again soon.
+ */
+static void ghost_push(struct archive *arc, struct archive_data *data)
+{
+	struct arc_private *p = arc_priv(arc);
+	struct arc_data_private *dp = arc_data_priv(data);
+	if (!p->ghosts || dp->ghost || dp->allocated)
+		return;
+	// the entry in the overwritten slot forgets its ghost, unless it was
+	// ghosted again since (into a newer slot)
+	uint32_t old = p->ghosts[p->ghost_pos];
+	if (old != UINT32_MAX) {
+		struct arc_data_private *prev = arc_data_priv(p->handles[old]);
+		if (prev->ghost_slot == p->ghost_pos)
+			prev->ghost = 0;
+	}
+	p->ghosts[p->ghost_pos] = dp->index;
+	dp->ghost_slot = p->ghost_pos;
+	dp->ghost = 1;
+	p->ghost_pos = (p->ghost_pos + 1) % p->nr_ghosts;
+}
+
+/*
+ * Unlink an entry from the cache. The cache's reference is NOT released.
+ */
+static void cache_remove_locked(struct archive *arc, struct archive_data *data)
+{
+	struct arc_private *p = arc_priv(arc);
+	struct arc_data_private *dp = arc_data_priv(data);
+	size_t cost = cache_cost(data);
+	if (dp->probation) {
+		TAILQ_REMOVE(&p->probation, dp, entry);
+		p->probation_used -= cost;
+		dp->probation = 0;
+	} else {
+		TAILQ_REMOVE(&p->cache, dp, entry);
+	}
+	dp->cached = 0;
+	p->nr_cached--;
+	p->cache_used -= cost;
+	atomic_fetch_sub(&p->group->used, cost);
+	atomic_fetch_sub(&global_cache.used, cost);
+}
+
+static void cache_evict_entry_locked(struct archive *arc, struct archive_data *evicted)
+{
+	if (arc_data_priv(evicted)->probation)
+		ghost_push(arc, evicted);
+	stats_add(arc, cache_evictions, 1);
+	cache_remove_locked(arc, evicted);
+	data_release_locked(evicted);
+}
+
+static void cache_evict_locked(struct archive *arc)
+{
+	cache_evict_entry_locked(arc, cache_victim(arc));
+}
+
+/*
+ * The last entry in a cache queue that costs something, or NULL.
+ */
+static struct archive_data *cache_last_costly(struct cache_head *head)
+{
+	struct arc_data_private *data = TAILQ_LAST(head, cache_head);
+	while (data && !cache_cost(&data->pub))
+		data = TAILQ_PREV(data, cache_head, entry);
+	return data ? &data->pub : NULL;
+}
+
+/*
+ * Choose the next entry to evict to meet a shared budget. This is the same
+ * choice as cache_victim(), except that entries which cost nothing are
+ * passed over, since evicting them would not help.
+ */
+static struct archive_data *cache_budget_victim(struct archive *arc)
+{
+	struct arc_private *p = arc_priv(arc);
+	struct archive_data *probation = cache_last_costly(&p->probation);
+	struct archive_data *lru = cache_last_costly(&p->cache);
+	if (probation && (!lru || p->probation_used > p->cache_limit / 4))
+		return probation;
+	return lru;
+}
+
+static void cache_flush_locked(struct archive *arc)
+{
+	while (arc_priv(arc)->nr_cached) {
+		cache_evict_locked(arc);
+	}
+}
+
+/*
+ * Find the archive in a group whose next budget victim is older than
+ * `*oldest`.
+ */
+static void cache_find_victim(struct arc_cache_group *group, uint64_t *oldest,
+		struct archive **victim)
+{
+	struct arc_private *p;
+	TAILQ_FOREACH(p, &group->archives, budget_entry) {
+		struct archive *arc = &p->pub;
+		arc_lock(arc);
+		struct archive_data *last = cache_budget_victim(arc);
+		if (last && arc_data_priv(last)->last_use < *oldest) {
+			*oldest = arc_data_priv(last)->last_use;
+			*victim = arc;
+		}
+		arc_unlock(arc);
+	}
+}
+
+/*
+ * Evict entries until `used` is within `limit`. If `group` is NULL, entries
+ * are evicted from all archives; otherwise only from archives in `group`.
+ * Eviction approximates a global LRU: the archive whose least recently used
+ * entry is oldest is evicted from first.
+ *
+ * Must be called with the global cache lock held.
+ */
+static void cache_enforce_limit_locked(struct arc_cache_group *group, atomic_size_t *used,
+		size_t limit)
+{
+	while (atomic_load(used) > limit) {
+		struct archive *victim = NULL;
+		uint64_t oldest = UINT64_MAX;
+		if (group) {
+			cache_find_victim(group, &oldest, &victim);
+		} else {
+			struct arc_cache_group *g;
+			cache_find_victim(&default_group, &oldest, &victim);
+			TAILQ_FOREACH(g, &global_cache.groups, entry) {
+				cache_find_victim(g, &oldest, &victim);
+			}
+		}
+		if (!victim)
+			break;
+		arc_lock(victim);
+		struct archive_data *evicted = cache_budget_victim(victim);
+		if (evicted)
+			cache_evict_entry_locked(victim, evicted);
+		arc_unlock(victim);
+	}
+}
+
+static bool cache_over_limit(atomic_size_t *used, size_t limit)
+{
+	return limit && atomic_load(used) > limit;
+}
+
+/*
+ * Evict entries until the budget of `arc`'s group and the process-wide
+ * budget are met. If `arc` is NULL, only the process-wide budget is
+ * enforced.
+ *
+ * Must be called WITHOUT any archive lock held.
+ */
+static void cache_enforce_limits(struct archive *arc)
+{
+	struct arc_private *p = arc_priv(arc);
+	struct arc_cache_group *group = NULL;
+	if (arc) {
+		arc_lock(arc);
+		group = p->group;
+		arc_unlock(arc);
+	}
+	if (!cache_over_limit(&global_cache.used, atomic_load(&global_cache.limit))
+			&& !(group && cache_over_limit(&group->used, atomic_load(&group->limit))))
+		return;
+
+	pthread_mutex_lock(&global_cache.lock);
+	// group may have changed before the lock was taken
+	group = arc ? p->group : NULL;
+	size_t limit;
+	if (group && (limit = atomic_load(&group->limit)))
+		cache_enforce_limit_locked(group, &group->used, limit);
+	if ((limit = atomic_load(&global_cache.limit)))
+		cache_enforce_limit_locked(NULL, &global_cache.used, limit);
+	pthread_mutex_unlock(&global_cache.lock);
+}
+
+void archive_set_global_cache_limit(size_t bytes)
+{
+	atomic_store(&global_cache.limit, bytes);
+	cache_enforce_limits(NULL);
+}
+
+struct arc_cache_group *arc_cache_group_new(void)
+{
+	struct arc_cache_group *group = xcalloc(1, sizeof(struct arc_cache_group));
+	TAILQ_INIT(&group->archives);
+	pthread_mutex_lock(&global_cache.lock);
+	TAILQ_INSERT_TAIL(&global_cache.groups, group, entry);
+	pthread_mutex_unlock(&global_cache.lock);
+	return group;
+}
+
+void arc_cache_group_free(struct arc_cache_group *group)
+{
+	pthread_mutex_lock(&global_cache.lock);
+	if (!TAILQ_EMPTY(&group->archives))
+		ERROR("cache group freed while archives remain in it");
+	TAILQ_REMOVE(&global_cache.groups, group, entry);
+	pthread_mutex_unlock(&global_cache.lock);
+	free(group);
 }
 
-void archive_set_cache_size(struct archive *arc, unsigned cache_size)
+void arc_cache_group_set_limit(struct arc_cache_group *group, size_t bytes)
 {
-	if (cache_size)
+	pthread_mutex_lock(&global_cache.lock);
+	atomic_store(&group->limit, bytes);
+	if (bytes)
+		cache_enforce_limit_locked(group, &group->used, bytes);
+	pthread_mutex_unlock(&global_cache.lock);
+}
+
+void arc_set_cache_group(struct archive *arc, struct arc_cache_group *group)
+{
+	struct arc_private *p = arc_priv(arc);
+	if (!group)
+		group = &default_group;
+
+	pthread_mutex_lock(&global_cache.lock);
+	arc_lock(arc);
+	struct arc_cache_group *old = p->group;
+	if (old != group) {
+		TAILQ_REMOVE(&old->archives, p, budget_entry);
+		atomic_fetch_sub(&old->used, p->cache_used);
+		atomic_fetch_add(&group->used, p->cache_used);
+		p->group = group;
+		TAILQ_INSERT_TAIL(&group->archives, p, budget_entry);
+	}
+	arc_unlock(arc);
+	pthread_mutex_unlock(&global_cache.lock);
+	cache_enforce_limits(arc);
+}
+
+void archive_set_cache_limit(struct archive *arc, size_t bytes)
+{
+	struct arc_private *p = arc_priv(arc);
+	arc_lock(arc);
+	if (bytes)
 		arc->flags |= ARCHIVE_CACHE;
 	else
 		arc->flags &= ~ARCHIVE_CACHE;
 
-	arc->cache_size = cache_size;
-	while (arc->nr_cached > cache_size) {
-		struct archive_data *evicted = TAILQ_LAST(&arc->cache, cache_head);
-		TAILQ_REMOVE(&arc->cache, evicted, entry);
-		evicted->cached = 0;
-		archive_data_release(evicted);
-		arc->nr_cached--;
+	p->cache_limit = bytes;
+	while (p->nr_cached && p->cache_used > bytes) {
+		cache_evict_locked(arc);
+	}
+	arc_unlock(arc);
+}
+
+void archive_set_cache_policy(struct archive *arc, enum archive_cache_policy policy)
+{
+	struct arc_private *p = arc_priv(arc);
+	arc_lock(arc);
+	cache_flush_locked(arc);
+	if (p->ghosts) {
+		for (unsigned i = 0; i < p->nr_ghosts; i++) {
+			if (p->ghosts[i] != UINT32_MAX)
+				arc_data_priv(p->handles[p->ghosts[i]])->ghost = 0;
+		}
+		free(p->ghosts);
+		p->ghosts = NULL;
 	}
+	if (policy == ARCHIVE_CACHE_2Q) {
+		// remember evictions for up to half the files in the archive
+		p->nr_ghosts = max(arc->meta.nr_files / 2, 16);
+		p->ghosts = xmalloc(p->nr_ghosts * sizeof(uint32_t));
+		p->ghost_pos = 0;
+		for (unsigned i = 0; i < p->nr_ghosts; i++) {
+			p->ghosts[i] = UINT32_MAX;
+		}
+	}
+	p->cache_policy = policy;
+	arc_unlock(arc);
 }
 
 static void archive_cache_add(struct archive_data *data)
 {
+	struct arc_data_private *dp = arc_data_priv(data);
 	struct archive *arc = data->archive;
 	if (!arc || !(arc->flags & ARCHIVE_CACHE))
 		return;
+	struct arc_private *p = arc_priv(arc);
+	if (dp->pinned || dp->priority == ARCHIVE_PRIORITY_LOW)
+		return;
+
+	dp->last_use = atomic_fetch_add(&global_cache.clock, 1);
 
-	// already cached: move to font
-	if (data->cached) {
-		assert(data->ref);
-		if (data != TAILQ_FIRST(&arc->cache)) {
-			TAILQ_REMOVE(&arc->cache, data, entry);
-			TAILQ_INSERT_HEAD(&arc->cache, data, entry);
+	// already cached: move to font (hits in the probationary queue do not
+	// change its order)
+	if (dp->cached) {
+		assert(dp->ref);
+		if (!dp->probation && dp != TAILQ_FIRST(&p->cache)) {
+			TAILQ_REMOVE(&p->cache, dp, entry);
+			TAILQ_INSERT_HEAD(&p->cache, dp, entry);
 		}
 		return;
 	}
 
-	// evict least recently used file
-	if (arc->nr_cached == arc->cache_size) {
-		struct archive_data *evicted = TAILQ_LAST(&arc->cache, cache_head);
-		TAILQ_REMOVE(&arc->cache, evicted, entry);
-		evicted->cached = 0;
-		archive_data_release(evicted);
+	// entry is larger than the whole budget: don't cache it
+	size_t cost = cache_cost(data);
+	if (cost > p->cache_limit)
+		return;
+
+	// evict least recently used files
+	while (p->nr_cached && p->cache_used + cost > p->cache_limit)
+		cache_evict_locked(arc);
+
+	// Under 2Q, new entries go to the probationary queue unless they were
+	// evicted from it recently (or are marked high priority), so that a
+	// single scan over the archive cannot flush the main queue.
+	if (p->cache_policy == ARCHIVE_CACHE_2Q && !dp->ghost
+			&& dp->priority != ARCHIVE_PRIORITY_HIGH) {
+		TAILQ_INSERT_HEAD(&p->probation, dp, entry);
+		p->probation_used += cost;
+		dp->probation = 1;
 	} else {
-		arc->nr_cached++;
+		TAILQ_INSERT_HEAD(&p->cache, dp, entry);
+	}
+	dp->ghost = 0;
+	dp->cached = 1;
+	dp->ref++;
+	p->nr_cached++;
+	p->cache_used += cost;
+	atomic_fetch_add(&p->group->used, cost);
+	atomic_fetch_add(&global_cache.used, cost);
+}
+
+void archive_data_pin(struct archive_data *data)
+{
+	struct arc_data_private *dp = arc_data_priv(data);
+	struct archive *arc = data->archive;
+	arc_lock(arc);
+	if (dp->ref && !dp->pinned) {
+		// the cache's reference (if any) becomes the pin's reference
+		if (dp->cached)
+			cache_remove_locked(arc, data);
+		else
+			dp->ref++;
+		dp->pinned = 1;
+	}
+	arc_unlock(arc);
+}
+
+void archive_data_unpin(struct archive_data *data)
+{
+	struct arc_data_private *dp = arc_data_priv(data);
+	struct archive *arc = data->archive;
+	arc_lock(arc);
+	if (dp->pinned) {
+		dp->pinned = 0;
+		data_release_locked(data);
 	}
+	arc_unlock(arc);
+}
 
-	// add to front of cache
-	TAILQ_INSERT_HEAD(&arc->cache, data, entry);
-	data->cached = 1;
-	data->ref++;
+void archive_data_set_priority(struct archive_data *data, enum archive_priority priority)
+{
+	struct arc_data_private *dp = arc_data_priv(data);
+	struct archive *arc = data->archive;
+	arc_lock(arc);
+	dp->priority = priority;
+	if (priority == ARCHIVE_PRIORITY_LOW && dp->cached) {
+		cache_remove_locked(arc, data);
+		data_release_locked(data);
+	}
+	arc_unlock(arc);
+}
+
+void archive_get_stats(struct archive *arc, struct archive_stats *out)
+{
+	struct arc_private *p = arc_priv(arc);
+	counters_get(&p->stats, out);
+	arc_lock(arc);
+	out->resident_bytes = p->cache_used;
+	arc_unlock(arc);
+}
+
+void archive_get_global_stats(struct archive_stats *out)
+{
+	counters_get(&global_stats, out);
+	out->resident_bytes = atomic_load(&global_cache.used);
+}
+
+void archive_reset_stats(struct archive *arc)
+{
+	counters_reset(&arc_priv(arc)->stats);
+}
+
+void archive_reset_global_stats(void)
+{
+	counters_reset(&global_stats);
+}
+
+void archive_close(struct archive *arc)
+{
+	struct arc_private *p = arc_priv(arc);
+	pthread_mutex_lock(&global_cache.lock);
+	TAILQ_REMOVE(&p->group->archives, p, budget_entry);
+	pthread_mutex_unlock(&global_cache.lock);
+	cache_flush_locked(arc);
+
+	// pinned entries are not in the cache: drop their pins here
+	for (unsigned i = 0; p->handles && i < arc->meta.nr_files; i++) {
+		struct archive_data *data = atomic_load(&p->handles[i]);
+		if (data && arc_data_priv(data)->pinned) {
+			arc_data_priv(data)->pinned = 0;
+			data_release_locked(data);
+		}
+	}
+
+	if (p->mapped) {
+		if (munmap(p->map.data, p->map.size))
+			WARNING("munmap: %s", strerror(errno));
+	} else if (p->use_pread) {
+		if (close(p->fd))
+			WARNING("close: %s", strerror(errno));
+	} else {
+		if (fclose(p->fp))
+			WARNING("fclose: %s", strerror(errno));
+	}
+	arc_index_free(arc);
+	arc_sidecar_close(arc);
+	free(p->ghosts);
+	if (arc->flags & ARCHIVE_THREADSAFE) {
+		pthread_mutex_destroy(&p->lock);
+		pthread_cond_destroy(&p->load_cond);
+	}
+	free(p);
+}
+
+/*
+ * Increment the reference count if it is non-zero. The 0 -> 1 transition
+ * always happens with the archive lock held, so a successful increment here
+ * means the data is loaded and will stay loaded.
+ */
+static bool data_ref_if_loaded(struct archive_data *data)
+{
+	struct arc_data_private *dp = arc_data_priv(data);
+	unsigned ref = atomic_load(&dp->ref);
+	while (ref) {
+		if (atomic_compare_exchange_weak(&dp->ref, &ref, ref + 1))
+			return true;
+	}
+	return false;
 }
 
 bool archive_data_load(struct archive_data *data)
 {
+	struct arc_data_private *dp = arc_data_priv(data);
+	struct archive *arc = data->archive;
+	struct arc_private *p = arc_priv(arc);
+
+	// fast path: data already loaded and no cache to update
+	if (!(arc->flags & ARCHIVE_CACHE) && data_ref_if_loaded(data)) {
+		stats_add(arc, cache_hits, 1);
+		return true;
+	}
+
+	arc_lock(arc);
+	while (dp->loading)
+		pthread_cond_wait(&p->load_cond, &p->lock);
+
 	// data already loaded by another caller
-	if (data->ref) {
+	if (dp->ref) {
 		archive_cache_add(data);
-		data->ref++;
+		dp->ref++;
+		arc_unlock(arc);
+		stats_add(arc, cache_hits, 1);
 		return true;
 	}
-	assert(!data->cached);
-	archive_cache_add(data);
-
+	stats_add(arc, cache_misses, 1);
+	assert(!dp->cached);
 	assert(!data->data);
 
-	// load data
-	if (data->archive->mapped) {
-		data->data = data->archive->map.data + data->offset;
-		data->size = data->raw_size;
-		data->mapped = true;
-	} else {
-		if (fseek(data->archive->fp, data->offset, SEEK_SET)) {
-			WARNING("fseek: %s", strerror(errno));
-			return false;
+	// load data (without holding the lock)
+	dp->loading = 1;
+	arc_unlock(arc);
+
+	size_t size;
+	bool mapped;
+	uint8_t *buf = data_read(data, &size, &mapped);
+
+	arc_lock(arc);
+	dp->loading = 0;
+	if (buf) {
+		data->data = buf;
+		data->size = size;
+		dp->mapped = mapped;
+		dp->ref++;
+		archive_cache_add(data);
+	}
+	if (arc->flags & ARCHIVE_THREADSAFE)
+		pthread_cond_broadcast(&p->load_cond);
+	arc_unlock(arc);
+
+	cache_enforce_limits(arc);
+	return buf != NULL;
+}
+
+/*
+ * Batch loading.
+ *
+ * Entries are sorted by offset and adjacent (or nearly adjacent) entries are
+ * read together in a single large read. Decompression is then spread across
+ * the calling thread and a shared pool of worker threads.
+ */
+
+#define BATCH_MAX_GAP  (64 * 1024)
+#define BATCH_MAX_SPAN (8 * 1024 * 1024)
+
+struct batch_job {
+	struct archive_data *file;
+	unsigned slot; // index in caller's array
+	uint8_t *raw;  // raw data (in mapped region or span buffer)
+	uint8_t *data; // loaded data
+	size_t size;
+	bool mapped;
+};
+
+struct batch_span {
+	uint32_t start;
+	uint32_t end;
+	unsigned first_job;
+	unsigned nr_jobs;
+	uint8_t *buf;
+};
+
+struct batch_ctx {
+	struct batch_job *jobs;
+	unsigned nr_jobs;
+	atomic_uint next;
+};
+
+unsigned arc_nr_processors(void)
+{
+#ifdef _WIN32
+	return pthread_num_processors_np();
+#else
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? n : 1;
+#endif
+}
+
+static int batch_job_cmp(const void *_a, const void *_b)
+{
+	const struct batch_job *a = _a, *b = _b;
+	if (a->file->offset < b->file->offset)
+		return -1;
+	return a->file->offset > b->file->offset;
+}
+
+static void batch_decompress(struct batch_job *job)
+{
+	if (!job->raw)
+		return;
+
+	size_t size = job->file->raw_size;
+	bool mapped = true; // raw data is not owned by the job
+	uint8_t *data = data_decompress(job->file, job->raw, &size, &mapped);
+	if (data && data == job->raw && !arc_priv(job->file->archive)->mapped) {
+		// data was not transformed: copy it out of the span buffer
+		data = xmalloc(size);
+		memcpy(data, job->raw, size);
+		mapped = false;
+	}
+	job->data = data;
+	job->size = size;
+	job->mapped = mapped;
+}
+
+static void *batch_worker(void *_ctx)
+{
+	struct batch_ctx *ctx = _ctx;
+	unsigned i;
+	while ((i = atomic_fetch_add(&ctx->next, 1)) < ctx->nr_jobs) {
+		batch_decompress(&ctx->jobs[i]);
+	}
+	return NULL;
+}
+
+/*
+ * Worker threads for batch decompression. The pool is created on first use
+ * and lives until the process exits, so that loading a batch does not pay
+ * for thread startup. It works on one batch at a time; while it is busy,
+ * other batches are decompressed by their calling thread alone.
+ */
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond; // signalled when a batch is posted
+	pthread_cond_t done_cond; // signalled when the last worker leaves a batch
+	bool started;
+	unsigned nr_threads;
+	struct batch_ctx *ctx;    // batch being worked on (NULL if none)
+	unsigned generation;      // incremented for each batch posted
+	unsigned nr_active;       // workers in `ctx`
+} batch_pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.work_cond = PTHREAD_COND_INITIALIZER,
+	.done_cond = PTHREAD_COND_INITIALIZER,
+};
+
+static void *batch_pool_worker(void *unused)
+{
+	pthread_mutex_lock(&batch_pool.lock);
+	unsigned seen = batch_pool.generation;
+	for (;;) {
+		while (!batch_pool.ctx || batch_pool.generation == seen)
+			pthread_cond_wait(&batch_pool.work_cond, &batch_pool.lock);
+		seen = batch_pool.generation;
+		struct batch_ctx *ctx = batch_pool.ctx;
+		batch_pool.nr_active++;
+		pthread_mutex_unlock(&batch_pool.lock);
+
+		batch_worker(ctx);
+
+		pthread_mutex_lock(&batch_pool.lock);
+		if (--batch_pool.nr_active == 0)
+			pthread_cond_broadcast(&batch_pool.done_cond);
+	}
+	return NULL;
+}
+
+/*
+ * Must be called with the pool lock held.
+ */
+static void batch_pool_start(void)
+{
+	batch_pool.started = true;
+	unsigned n = arc_nr_processors() - 1;
+	for (unsigned i = 0; i < n; i++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, batch_pool_worker, NULL))
+			break;
+		pthread_detach(thread);
+		batch_pool.nr_threads++;
+	}
+}
+
+/*
+ * Decompress all jobs of a batch, on the calling thread and (if it is idle)
+ * the worker pool.
+ */
+static void batch_run(struct batch_ctx *ctx)
+{
+	bool pooled = false;
+	if (ctx->nr_jobs > 1) {
+		pthread_mutex_lock(&batch_pool.lock);
+		if (!batch_pool.started)
+			batch_pool_start();
+		if (batch_pool.nr_threads && !batch_pool.ctx) {
+			batch_pool.ctx = ctx;
+			batch_pool.generation++;
+			pthread_cond_broadcast(&batch_pool.work_cond);
+			pooled = true;
 		}
-		data->data = xmalloc(data->raw_size);
-		if (fread(data->data, data->raw_size, 1, data->archive->fp) != 1) {
-			WARNING("fread: %s", strerror(errno));
-			free(data->data);
-			return false;
+		pthread_mutex_unlock(&batch_pool.lock);
+	}
+
+	batch_worker(ctx);
+
+	if (pooled) {
+		// all jobs are claimed; wait for workers still decompressing
+		pthread_mutex_lock(&batch_pool.lock);
+		batch_pool.ctx = NULL;
+		while (batch_pool.nr_active)
+			pthread_cond_wait(&batch_pool.done_cond, &batch_pool.lock);
+		pthread_mutex_unlock(&batch_pool.lock);
+	}
+}
+
+static unsigned batch_plan_spans(struct batch_job *jobs, unsigned nr_jobs,
+		struct batch_span *spans)
+{
+	unsigned nr_spans = 0;
+	for (unsigned i = 0; i < nr_jobs; i++) {
+		uint32_t start = jobs[i].file->offset;
+		uint32_t end = start + jobs[i].file->raw_size;
+		struct batch_span *span = nr_spans ? &spans[nr_spans - 1] : NULL;
+		if (span && start <= span->end + BATCH_MAX_GAP
+				&& max(end, span->end) - span->start <= BATCH_MAX_SPAN) {
+			span->end = max(end, span->end);
+			span->nr_jobs++;
+			continue;
 		}
-		data->size = data->raw_size;
+		spans[nr_spans++] = (struct batch_span) {
+			.start = start,
+			.end = end,
+			.first_job = i,
+			.nr_jobs = 1,
+		};
 	}
+	return nr_spans;
+}
 
-	if (!data_decompress(data))
-		return false;
+static void batch_read_spans(struct archive *arc, struct batch_job *jobs,
+		struct batch_span *spans, unsigned nr_spans)
+{
+	// queue readahead for every span before blocking on the first one
+	for (unsigned i = 0; i < nr_spans; i++) {
+		prefetch_range(arc, spans[i].start, spans[i].end - spans[i].start);
+	}
+	for (unsigned i = 0; i < nr_spans; i++) {
+		struct batch_span *span = &spans[i];
+		span->buf = xmalloc(span->end - span->start);
+		if (!arc_read(arc, span->buf, span->end - span->start, span->start)) {
+			free(span->buf);
+			span->buf = NULL;
+			continue;
+		}
+		for (unsigned j = 0; j < span->nr_jobs; j++) {
+			struct batch_job *job = &jobs[span->first_job + j];
+			job->raw = span->buf + (job->file->offset - span->start);
+		}
+	}
+}
 
-	data->ref++;
-	return true;
+/*
+ * Load a batch of entries. On return, each non-NULL element of `files` is
+ * loaded and the caller owns a reference to it; entries which failed to load
+ * are set to NULL.
+ */
+static void load_batch(struct archive *arc, struct archive_data **files, unsigned n)
+{
+	struct arc_private *p = arc_priv(arc);
+	struct batch_job *jobs = xcalloc(n ? n : 1, sizeof(struct batch_job));
+	bool *deferred = xcalloc(n ? n : 1, sizeof(bool));
+	unsigned nr_jobs = 0;
+
+	// claim entries which are not yet loaded
+	arc_lock(arc);
+	for (unsigned i = 0; i < n; i++) {
+		struct archive_data *file = files[i];
+		if (!file)
+			continue;
+		if (arc_data_priv(file)->ref) {
+			archive_cache_add(file);
+			arc_data_priv(file)->ref++;
+			stats_add(arc, cache_hits, 1);
+		} else if (arc_data_priv(file)->loading) {
+			// being loaded by another thread (or duplicated in this
+			// batch): load it the normal way afterwards
+			deferred[i] = true;
+		} else {
+			stats_add(arc, cache_misses, 1);
+			arc_data_priv(file)->loading = 1;
+			jobs[nr_jobs].file = file;
+			jobs[nr_jobs].slot = i;
+			nr_jobs++;
+		}
+	}
+	arc_unlock(arc);
+
+	// read raw data
+	struct batch_span *spans = NULL;
+	unsigned nr_spans = 0;
+	qsort(jobs, nr_jobs, sizeof(struct batch_job), batch_job_cmp);
+	if (p->mapped) {
+		for (unsigned i = 0; i < nr_jobs; i++) {
+			prefetch_range(arc, jobs[i].file->offset, jobs[i].file->raw_size);
+			jobs[i].raw = p->map.data + jobs[i].file->offset;
+			stats_add(arc, bytes_mapped, jobs[i].file->raw_size);
+		}
+	} else {
+		spans = xcalloc(nr_jobs ? nr_jobs : 1, sizeof(struct batch_span));
+		nr_spans = batch_plan_spans(jobs, nr_jobs, spans);
+		batch_read_spans(arc, jobs, spans, nr_spans);
+	}
+
+	// decompress
+	struct batch_ctx ctx = { .jobs = jobs, .nr_jobs = nr_jobs };
+	batch_run(&ctx);
+
+	for (unsigned i = 0; i < nr_spans; i++) {
+		free(spans[i].buf);
+	}
+	free(spans);
+
+	// publish results
+	arc_lock(arc);
+	for (unsigned i = 0; i < nr_jobs; i++) {
+		struct archive_data *file = jobs[i].file;
+		arc_data_priv(file)->loading = 0;
+		if (!jobs[i].data) {
+			files[jobs[i].slot] = NULL;
+			continue;
+		}
+		file->data = jobs[i].data;
+		file->size = jobs[i].size;
+		arc_data_priv(file)->mapped = jobs[i].mapped;
+		arc_data_priv(file)->ref++;
+		archive_cache_add(file);
+	}
+	if (arc->flags & ARCHIVE_THREADSAFE)
+		pthread_cond_broadcast(&p->load_cond);
+	arc_unlock(arc);
+	cache_enforce_limits(arc);
+
+	// load stragglers
+	for (unsigned i = 0; i < n; i++) {
+		if (deferred[i] && !archive_data_load(files[i]))
+			files[i] = NULL;
+	}
+	free(deferred);
+	free(jobs);
 }
 
-int archive_get_index(struct archive *arc, const char *name)
+unsigned archive_get_batch(struct archive *arc, const char **names, unsigned n,
+		struct archive_data **out)
 {
-	// convert name to uppercase
-	int i;
-	char upname[256];
-	for (i = 0; name[i] && i < 255; i++) {
-		upname[i] = toupper(name[i]);
+	for (unsigned i = 0; i < n; i++) {
+		int index = archive_get_index(arc, names[i]);
+		out[i] = index < 0 ? NULL : archive_entry(arc, index);
 	}
-	upname[i] = 0;
 
-	hashtable_iter_t k = hashtable_get(arcindex, &arc->index, upname);
-	if (k == hashtable_end(&arc->index))
-		return -1;
-	return hashtable_val(&arc->index, k);
+	load_batch(arc, out, n);
+
+	unsigned nr_loaded = 0;
+	for (unsigned i = 0; i < n; i++) {
+		if (out[i])
+			nr_loaded++;
+	}
+	return nr_loaded;
+}
+
+/*
+ * Bulk extraction.
+ *
+ * Workers claim entries in index order and read and decompress them
+ * independently. An entry is only claimed while the bytes held by entries
+ * in flight (raw data while reading, decompressed data until delivered)
+ * are within the budget, so memory use stays bounded no matter how many
+ * entries complete out of order. Because claims happen in index order, the
+ * next entry to deliver in ordered mode has always been claimed already,
+ * and waiting on the budget cannot deadlock.
+ */
+
+#define EXTRACT_BUDGET (64 * 1024 * 1024)
+
+struct extract_result {
+	uint8_t *data;
+	size_t size;
+	bool mapped;
+	bool done;
+};
+
+struct extract_ctx {
+	struct archive *arc;
+	archive_extract_callback callback;
+	void *user;
+	bool ordered;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	size_t budget;
+	size_t in_flight;      // bytes held by claimed entries
+	unsigned next;         // next entry to claim
+	unsigned next_deliver; // next entry to deliver (ordered mode)
+	bool delivering;       // a thread is delivering results (ordered mode)
+	bool failed;
+	bool aborted;
+	struct extract_result *results; // ordered mode only
+	pthread_mutex_t read_lock;      // serializes stdio reads
+	pthread_mutex_t callback_lock;  // serializes callbacks (unordered mode)
+};
+
+static size_t extract_cost(struct extract_result *r)
+{
+	return r->mapped ? 0 : r->size;
+}
+
+static void extract_result_free(struct extract_result *r)
+{
+	if (!r->mapped)
+		free(r->data);
+	r->data = NULL;
+}
+
+static bool extract_deliver(struct extract_ctx *ctx, unsigned i, struct extract_result *r)
+{
+	if (!r->data)
+		return true;
+	struct archive_data *file = archive_entry(ctx->arc, i);
+	return ctx->callback(file, r->data, r->size, ctx->user);
+}
+
+/*
+ * Deliver completed results in index order, starting at `next_deliver`.
+ * Called with the lock held.
+ */
+static void extract_deliver_ordered(struct extract_ctx *ctx)
+{
+	if (ctx->delivering)
+		return;
+	ctx->delivering = true;
+	while (ctx->next_deliver < ctx->arc->meta.nr_files
+			&& ctx->results[ctx->next_deliver].done) {
+		unsigned i = ctx->next_deliver++;
+		struct extract_result r = ctx->results[i];
+		pthread_mutex_unlock(&ctx->lock);
+		bool ok = ctx->aborted || extract_deliver(ctx, i, &r);
+		extract_result_free(&r);
+		pthread_mutex_lock(&ctx->lock);
+		if (!ok)
+			ctx->aborted = true;
+		ctx->in_flight -= extract_cost(&r);
+		pthread_cond_broadcast(&ctx->cond);
+	}
+	ctx->delivering = false;
+}
+
+static void *extract_worker(void *_ctx)
+{
+	struct extract_ctx *ctx = _ctx;
+	struct archive *arc = ctx->arc;
+	struct arc_private *p = arc_priv(arc);
+	const bool lock_reads = !p->mapped && !p->use_pread;
+
+	pthread_mutex_lock(&ctx->lock);
+	while (!ctx->aborted && ctx->next < arc->meta.nr_files) {
+		// wait for the budget (an entry is always admitted if nothing
+		// else is in flight)
+		const unsigned i = ctx->next;
+		const size_t raw_cost = p->mapped ? 0 : p->index.raw_size[i];
+		if (ctx->in_flight && ctx->in_flight + raw_cost > ctx->budget) {
+			pthread_cond_wait(&ctx->cond, &ctx->lock);
+			continue;
+		}
+		ctx->next++;
+		ctx->in_flight += raw_cost;
+		pthread_mutex_unlock(&ctx->lock);
+
+		struct extract_result r = { .done = true };
+		struct archive_data *file = archive_entry(arc, i);
+		if (lock_reads)
+			pthread_mutex_lock(&ctx->read_lock);
+		r.data = data_read(file, &r.size, &r.mapped);
+		if (lock_reads)
+			pthread_mutex_unlock(&ctx->read_lock);
+
+		pthread_mutex_lock(&ctx->lock);
+		ctx->in_flight = ctx->in_flight - raw_cost + extract_cost(&r);
+		if (!r.data) {
+			WARNING("Failed to extract %s", file->name);
+			ctx->failed = true;
+		}
+		if (ctx->ordered) {
+			ctx->results[i] = r;
+			extract_deliver_ordered(ctx);
+			continue;
+		}
+
+		pthread_mutex_unlock(&ctx->lock);
+		pthread_mutex_lock(&ctx->callback_lock);
+		bool ok = ctx->aborted || extract_deliver(ctx, i, &r);
+		pthread_mutex_unlock(&ctx->callback_lock);
+		extract_result_free(&r);
+		pthread_mutex_lock(&ctx->lock);
+		if (!ok)
+			ctx->aborted = true;
+		ctx->in_flight -= extract_cost(&r);
+		pthread_cond_broadcast(&ctx->cond);
+	}
+	// wake up threads waiting on the budget so they can see the end
+	pthread_cond_broadcast(&ctx->cond);
+	pthread_mutex_unlock(&ctx->lock);
+	return NULL;
+}
+
+bool archive_extract_all(struct archive *arc, archive_extract_callback callback,
+		void *user, unsigned nr_threads, bool ordered)
+{
+	struct extract_ctx ctx = {
+		.arc = arc,
+		.callback = callback,
+		.user = user,
+		.ordered = ordered,
+		.budget = EXTRACT_BUDGET,
+	};
+	pthread_mutex_init(&ctx.lock, NULL);
+	pthread_cond_init(&ctx.cond, NULL);
+	pthread_mutex_init(&ctx.read_lock, NULL);
+	pthread_mutex_init(&ctx.callback_lock, NULL);
+	if (ordered)
+		ctx.results = xcalloc(max(arc->meta.nr_files, 1), sizeof(struct extract_result));
+
+	if (!nr_threads)
+		nr_threads = arc_nr_processors();
+	nr_threads = min(nr_threads, max(arc->meta.nr_files, 1));
+
+	// the calling thread is one of the workers
+	pthread_t *threads = xcalloc(max(nr_threads, 1), sizeof(pthread_t));
+	unsigned nr_started = 0;
+	for (; nr_started < nr_threads - 1; nr_started++) {
+		if (pthread_create(&threads[nr_started], NULL, extract_worker, &ctx))
+			break;
+	}
+	extract_worker(&ctx);
+	for (unsigned i = 0; i < nr_started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	free(threads);
+
+	// free results left undelivered after an abort
+	if (ordered) {
+		for (unsigned i = ctx.next_deliver; i < arc->meta.nr_files; i++) {
+			extract_result_free(&ctx.results[i]);
+		}
+		free(ctx.results);
+	}
+	pthread_mutex_destroy(&ctx.lock);
+	pthread_cond_destroy(&ctx.cond);
+	pthread_mutex_destroy(&ctx.read_lock);
+	pthread_mutex_destroy(&ctx.callback_lock);
+	return !ctx.failed && !ctx.aborted;
+}
+
+int archive_get_index(struct archive *arc, const char *name)
+{
+	return arc_name_table_lookup(arc, name);
 }
 
 struct archive_data *archive_get(struct archive *arc, const char *name)
@@ -834,9 +2087,7 @@ struct archive_data *archive_get(struct archive *arc, const char *name)
 	if (i < 0)
 		return NULL;
 
-	// XXX: Because we're giving out pointers into arc->files, the vector must
-	//      never be resized.
-	struct archive_data *data = &vector_A(arc->files, i);
+	struct archive_data *data = archive_entry(arc, i);
 	if (archive_data_load(data))
 		return data;
 	return NULL;
@@ -844,10 +2095,10 @@ struct archive_data *archive_get(struct archive *arc, const char *name)
 
 struct archive_data *archive_get_by_index(struct archive *arc, unsigned i)
 {
-	if (i >= vector_length(arc->files))
+	struct archive_data *data = archive_entry(arc, i);
+	if (!data)
 		return NULL;
 
-	struct archive_data *data = &vector_A(arc->files, i);
 	if (archive_data_load(data))
 		return data;
 	return NULL;
@@ -855,14 +2106,66 @@ struct archive_data *archive_get_by_index(struct archive *arc, unsigned i)
 
 void archive_data_release(struct archive_data *data)
 {
-	if (data->ref == 0)
-		ERROR("double-free of archive data");
-	if (--data->ref == 0) {
-		if (!data->mapped)
-			free(data->data);
-		data->data = NULL;
-		data->size = 0;
-		if (data->allocated)
-			free(data);
+	struct arc_data_private *dp = arc_data_priv(data);
+	// fast path: reference count stays above zero
+	unsigned ref = atomic_load(&dp->ref);
+	while (ref > 1) {
+		if (atomic_compare_exchange_weak(&dp->ref, &ref, ref - 1))
+			return;
+	}
+
+	struct archive *arc = data->archive;
+	arc_lock(arc);
+	data_release_locked(data);
+	arc_unlock(arc);
+}
+
+bool archive_get_wav_by_index(struct archive *arc, unsigned i, struct archive_wav *wav)
+{
+	struct arc_private *p = arc_priv(arc);
+	if (i >= arc->meta.nr_files)
+		return false;
+	if ((arc->meta.type != ARCHIVE_TYPE_AWD && arc->meta.type != ARCHIVE_TYPE_AWF)
+			|| p->index.awd_type[i] != AWD_PCM) {
+		WARNING("Not a PCM entry: %s", arc_index_name(arc, i));
+		return false;
 	}
+
+	const uint32_t size = p->index.raw_size[i];
+	arc_write_wav_header(wav->header, size, arc->flags & ARCHIVE_STEREO);
+	wav->pcm_size = size;
+
+	if (p->mapped) {
+		// point directly into the mapped region
+		wav->pcm = p->map.data + p->index.offset[i];
+		wav->data = NULL;
+		stats_add(arc, bytes_mapped, size);
+		return true;
+	}
+
+	// PCM data is read directly after the WAV header, so the loaded entry
+	// can be used without copying
+	struct archive_data *data = archive_get_by_index(arc, i);
+	if (!data)
+		return false;
+	wav->pcm = data->data + 44;
+	wav->data = data;
+	return true;
+}
+
+bool archive_get_wav(struct archive *arc, const char *name, struct archive_wav *wav)
+{
+	int i = archive_get_index(arc, name);
+	if (i < 0)
+		return false;
+	return archive_get_wav_by_index(arc, i, wav);
+}
+
+void archive_wav_release(struct archive_wav *wav)
+{
+	if (wav->data)
+		archive_data_release(wav->data);
+	wav->data = NULL;
+	wav->pcm = NULL;
+	wav->pcm_size = 0;
 }
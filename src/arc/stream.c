@@ -0,0 +1,442 @@
+/* Copyright (C) 2023 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "nulib.h"
+#include "ai5/arc.h"
+#include "ai5/game.h"
+#include "ai5/lzss.h"
+#include "arc_internal.h"
+
+/*
+ * Streaming entry reader.
+ *
+ * A stream produces the same bytes as `archive_data_load`, but holds only
+ * a fixed amount of memory: the LZSS decoder state (including its 4 KB ring
+ * frame) and a small buffer of compressed input. Input for mapped archives
+ * is read directly from the mapping.
+ *
+ * With ARCHIVE_LZSS_CHECKPOINTS, a stream on an LZSS entry also saves the
+ * decoder state every ARCHIVE_CHECKPOINT_INTERVAL bytes of output, along
+ * with the amount of input consumed, so that a later seek can resume
+ * decoding from there. Checkpoint positions are fixed, so the entry's list
+ * (in its `archive_data`, guarded by the archive lock) only ever grows: a
+ * stream appends the checkpoints it recorded past the end of the list when
+ * it seeks, skips, reaches the end of the data or is closed. Loading an
+ * entry with `archive_data_load` records the complete list.
+ */
+
+#define STREAM_CHUNK_SIZE (16 * 1024)
+
+struct stream_checkpoint {
+	uint32_t raw_pos; // compressed bytes consumed
+	struct lzss_checkpoint state;
+};
+
+/*
+ * Checkpoint `i` is at output position `(i + 1) * ARCHIVE_CHECKPOINT_INTERVAL`.
+ */
+struct archive_checkpoints {
+	unsigned nr_checkpoints;
+	bool complete; // the entry has no further checkpoints
+	struct stream_checkpoint checkpoint[];
+};
+
+enum stream_mode {
+	STREAM_RAW,
+	STREAM_WAV,
+	STREAM_LZSS,
+};
+
+struct archive_stream {
+	struct archive *arc;
+	enum stream_mode mode;
+	uint32_t offset;   // offset of entry in archive
+	uint32_t raw_size; // size of entry in archive
+	uint32_t raw_pos;  // bytes of entry consumed so far
+	size_t pos;        // bytes of output produced so far
+	bool error;
+	uint8_t wav_header[44];
+	// STREAM_LZSS only
+	uint8_t *in_buf;
+	struct lzss_decoder dec;
+	struct archive_data *entry;
+	// checkpoints recorded by this stream and not yet added to the entry's
+	// list (NULL if not recording); `checkpoints->checkpoint[0]` is
+	// checkpoint `cp_first` of the entry
+	struct archive_checkpoints *checkpoints;
+	unsigned cp_first;
+};
+
+static void checkpoint_save(struct archive_checkpoints **list, uint32_t raw_pos,
+		const struct lzss_decoder *dec)
+{
+	struct archive_checkpoints *c = *list;
+	c = xrealloc(c, sizeof(struct archive_checkpoints)
+			+ (c->nr_checkpoints + 1) * sizeof(struct stream_checkpoint));
+	struct stream_checkpoint *cp = &c->checkpoint[c->nr_checkpoints++];
+	cp->raw_pos = raw_pos;
+	lzss_decoder_save(dec, &cp->state);
+	*list = c;
+}
+
+/*
+ * Add checkpoints `first` and up (recorded in `c`) to the entry's list. If
+ * `complete` is true, `c` runs to the end of the entry.
+ */
+static void checkpoints_publish(struct archive_data *data, unsigned first,
+		const struct archive_checkpoints *c, bool complete)
+{
+	struct arc_data_private *dp = arc_data_priv(data);
+	arc_lock(data->archive);
+	struct archive_checkpoints *list = dp->checkpoints;
+	const unsigned nr = list ? list->nr_checkpoints : 0;
+	const unsigned end = first + c->nr_checkpoints;
+	if (first <= nr && end >= nr) {
+		if (!list || end > nr) {
+			list = xrealloc(list, sizeof(struct archive_checkpoints)
+					+ end * sizeof(struct stream_checkpoint));
+			if (!nr)
+				list->complete = false;
+			memcpy(&list->checkpoint[nr], &c->checkpoint[nr - first],
+					(end - nr) * sizeof(struct stream_checkpoint));
+			list->nr_checkpoints = end;
+			dp->checkpoints = list;
+		}
+		if (complete)
+			list->complete = true;
+	}
+	arc_unlock(data->archive);
+}
+
+bool arc_checkpoints_complete(struct archive_data *data)
+{
+	struct arc_data_private *dp = arc_data_priv(data);
+	arc_lock(data->archive);
+	bool complete = dp->checkpoints && dp->checkpoints->complete;
+	arc_unlock(data->archive);
+	return complete;
+}
+
+/*
+ * Get the last checkpoint of the entry at or before output position `pos`.
+ * Returns its index, or -1 if there is none.
+ */
+static int checkpoint_find(struct archive_data *data, size_t pos, struct stream_checkpoint *out)
+{
+	int i = -1;
+	arc_lock(data->archive);
+	const struct archive_checkpoints *c = arc_data_priv(data)->checkpoints;
+	if (c && pos >= ARCHIVE_CHECKPOINT_INTERVAL && c->nr_checkpoints) {
+		i = min(pos / ARCHIVE_CHECKPOINT_INTERVAL, c->nr_checkpoints) - 1;
+		*out = c->checkpoint[i];
+	}
+	arc_unlock(data->archive);
+	return i;
+}
+
+uint8_t *arc_lzss_decompress_checkpoints(struct archive_data *data, const uint8_t *in,
+		size_t in_size, size_t *out_size)
+{
+	struct lzss_decoder dec;
+	lzss_decoder_init(&dec, game_is_aiwin());
+	lzss_decoder_input(&dec, in, in_size, true);
+
+	struct archive_checkpoints *c = xcalloc(1, sizeof(struct archive_checkpoints));
+	size_t cap = ARCHIVE_CHECKPOINT_INTERVAL;
+	size_t pos = 0;
+	uint8_t *out = xmalloc(cap);
+	while (true) {
+		// `cap` is a multiple of the interval
+		if (pos == cap) {
+			cap *= 2;
+			out = xrealloc(out, cap);
+		}
+		size_t n = ARCHIVE_CHECKPOINT_INTERVAL - pos % ARCHIVE_CHECKPOINT_INTERVAL;
+		size_t got = lzss_decoder_read(&dec, out + pos, n);
+		pos += got;
+		if (got < n)
+			break;
+		checkpoint_save(&c, dec.in_pos, &dec);
+	}
+	checkpoints_publish(data, 0, c, true);
+	free(c);
+	*out_size = pos;
+	return out;
+}
+
+/*
+ * Restart the LZSS decoder at checkpoint `cp` (checkpoint `cp_i` of the
+ * entry), or at the start of the entry if `cp` is NULL.
+ */
+static void stream_lzss_reset(struct archive_stream *s, const struct stream_checkpoint *cp,
+		int cp_i)
+{
+	const uint32_t raw_pos = cp ? cp->raw_pos : 0;
+	lzss_decoder_init(&s->dec, game_is_aiwin());
+	if (cp)
+		lzss_decoder_restore(&s->dec, &cp->state);
+	if (arc_priv(s->arc)->mapped) {
+		lzss_decoder_input(&s->dec, arc_priv(s->arc)->map.data + s->offset, s->raw_size, true);
+		s->dec.in_pos = raw_pos;
+		s->raw_pos = s->raw_size;
+	} else {
+		s->raw_pos = raw_pos;
+		lzss_decoder_input(&s->dec, s->in_buf, 0, raw_pos == s->raw_size);
+	}
+	s->error = false;
+
+	// record checkpoints unless the entry already has all of them
+	free(s->checkpoints);
+	s->checkpoints = NULL;
+	s->cp_first = cp ? cp_i + 1 : 0;
+	if ((s->arc->flags & ARCHIVE_LZSS_CHECKPOINTS) && !arc_checkpoints_complete(s->entry))
+		s->checkpoints = xcalloc(1, sizeof(struct archive_checkpoints));
+}
+
+/*
+ * Number of compressed bytes consumed by the decoder.
+ */
+static uint32_t stream_lzss_consumed(struct archive_stream *s)
+{
+	if (arc_priv(s->arc)->mapped)
+		return s->dec.in_pos;
+	return s->raw_pos - (s->dec.in_size - s->dec.in_pos);
+}
+
+/*
+ * Add the checkpoints recorded so far to the entry. If `complete` is true,
+ * the end of the data was reached and recording stops.
+ */
+static void stream_publish_checkpoints(struct archive_stream *s, bool complete)
+{
+	struct archive_checkpoints *c = s->checkpoints;
+	if (!c || (!c->nr_checkpoints && !complete))
+		return;
+	checkpoints_publish(s->entry, s->cp_first, c, complete);
+	if (complete) {
+		free(c);
+		s->checkpoints = NULL;
+	} else {
+		s->cp_first += c->nr_checkpoints;
+		c->nr_checkpoints = 0;
+	}
+}
+
+struct archive_stream *archive_stream_open_by_index(struct archive *arc, unsigned i)
+{
+	struct arc_private *p = arc_priv(arc);
+	if (i >= arc->meta.nr_files)
+		return NULL;
+
+	struct archive_stream *s = xcalloc(1, sizeof(struct archive_stream));
+	s->arc = arc;
+	s->offset = p->index.offset[i];
+	s->raw_size = p->index.raw_size[i];
+
+	if (arc->meta.type == ARCHIVE_TYPE_AWD || arc->meta.type == ARCHIVE_TYPE_AWF) {
+		if (p->index.awd_type[i] == AWD_PCM) {
+			s->mode = STREAM_WAV;
+			arc_write_wav_header(s->wav_header, s->raw_size,
+					arc->flags & ARCHIVE_STEREO);
+		} else {
+			s->mode = STREAM_RAW;
+		}
+	} else if (arc->flags & ARCHIVE_RAW) {
+		s->mode = STREAM_RAW;
+	} else {
+		s->mode = STREAM_LZSS;
+		s->entry = archive_entry(arc, i);
+		if (!p->mapped)
+			s->in_buf = xmalloc(STREAM_CHUNK_SIZE);
+		stream_lzss_reset(s, NULL, 0);
+	}
+	return s;
+}
+
+struct archive_stream *archive_stream_open(struct archive *arc, const char *name)
+{
+	int i = archive_get_index(arc, name);
+	if (i < 0)
+		return NULL;
+	return archive_stream_open_by_index(arc, i);
+}
+
+void archive_stream_close(struct archive_stream *s)
+{
+	if (s->checkpoints && !s->error)
+		stream_publish_checkpoints(s, false);
+	free(s->checkpoints);
+	free(s->in_buf);
+	free(s);
+}
+
+/*
+ * Copy raw entry data at the current raw position.
+ */
+static size_t stream_read_raw(struct archive_stream *s, uint8_t *buf, size_t size)
+{
+	size = min(size, s->raw_size - s->raw_pos);
+	if (!size)
+		return 0;
+	if (arc_priv(s->arc)->mapped) {
+		memcpy(buf, arc_priv(s->arc)->map.data + s->offset + s->raw_pos, size);
+	} else if (!arc_read(s->arc, buf, size, s->offset + s->raw_pos)) {
+		s->error = true;
+		return 0;
+	}
+	s->raw_pos += size;
+	return size;
+}
+
+/*
+ * Refill the input buffer of the LZSS decoder, keeping unconsumed input.
+ */
+static bool stream_refill(struct archive_stream *s)
+{
+	struct lzss_decoder *d = &s->dec;
+	size_t keep = d->in_size - d->in_pos;
+	memmove(s->in_buf, d->in + d->in_pos, keep);
+	size_t n = min(STREAM_CHUNK_SIZE - keep, s->raw_size - s->raw_pos);
+	if (n && !arc_read(s->arc, s->in_buf + keep, n, s->offset + s->raw_pos)) {
+		s->error = true;
+		return false;
+	}
+	s->raw_pos += n;
+	lzss_decoder_input(d, s->in_buf, keep + n, s->raw_pos == s->raw_size);
+	return true;
+}
+
+static size_t stream_read_lzss(struct archive_stream *s, uint8_t *buf, size_t size)
+{
+	size_t pos = 0;
+	while (pos < size) {
+		size_t n = size - pos;
+		size_t next_cp = 0;
+		if (s->checkpoints) {
+			// stop at the next checkpoint
+			next_cp = (size_t)(s->cp_first + s->checkpoints->nr_checkpoints + 1)
+				* ARCHIVE_CHECKPOINT_INTERVAL;
+			n = min(n, next_cp - (s->pos + pos));
+		}
+		size_t got = lzss_decoder_read(&s->dec, buf + pos, n);
+		pos += got;
+		if (s->checkpoints && s->pos + pos == next_cp)
+			checkpoint_save(&s->checkpoints, stream_lzss_consumed(s), &s->dec);
+		if (got == n)
+			continue;
+		if (s->dec.done || s->dec.in_final)
+			break;
+		if (!stream_refill(s))
+			break;
+	}
+	if (pos < size && s->checkpoints && !s->error)
+		stream_publish_checkpoints(s, true);
+	return pos;
+}
+
+size_t archive_stream_read(struct archive_stream *s, void *_buf, size_t size)
+{
+	uint8_t *buf = _buf;
+	size_t pos = 0;
+	if (s->error)
+		return 0;
+
+	switch (s->mode) {
+	case STREAM_WAV:
+		if (s->pos < 44) {
+			pos = min(size, 44 - s->pos);
+			memcpy(buf, s->wav_header + s->pos, pos);
+		}
+		// fallthrough
+	case STREAM_RAW:
+		pos += stream_read_raw(s, buf + pos, size - pos);
+		break;
+	case STREAM_LZSS:
+		pos = stream_read_lzss(s, buf, size);
+		break;
+	}
+	s->pos += pos;
+	return pos;
+}
+
+size_t archive_stream_skip(struct archive_stream *s, size_t size)
+{
+	if (s->error)
+		return 0;
+	if (s->mode == STREAM_LZSS) {
+		// decode into a scratch buffer
+		uint8_t buf[4096];
+		size_t skipped = 0;
+		while (skipped < size) {
+			size_t n = archive_stream_read(s, buf, min(size - skipped, sizeof(buf)));
+			if (!n)
+				break;
+			skipped += n;
+		}
+		if (s->checkpoints && !s->error)
+			stream_publish_checkpoints(s, false);
+		return skipped;
+	}
+
+	size_t skipped = 0;
+	if (s->mode == STREAM_WAV && s->pos < 44) {
+		skipped = min(size, 44 - s->pos);
+	}
+	size_t n = min(size - skipped, s->raw_size - s->raw_pos);
+	s->raw_pos += n;
+	skipped += n;
+	s->pos += skipped;
+	return skipped;
+}
+
+bool archive_stream_seek(struct archive_stream *s, size_t pos)
+{
+	if (s->mode != STREAM_LZSS) {
+		size_t hdr_size = s->mode == STREAM_WAV ? 44 : 0;
+		size_t end = hdr_size + s->raw_size;
+		s->pos = min(pos, end);
+		s->raw_pos = s->pos > hdr_size ? s->pos - hdr_size : 0;
+		s->error = false;
+		return pos <= end;
+	}
+
+	// find the nearest checkpoint at or before `pos`
+	if (s->checkpoints && !s->error)
+		stream_publish_checkpoints(s, false);
+	struct stream_checkpoint cp;
+	int cp_i = checkpoint_find(s->entry, pos, &cp);
+	size_t cp_pos = (size_t)(cp_i + 1) * ARCHIVE_CHECKPOINT_INTERVAL;
+
+	// restart, unless decoding on from the current position is closer
+	if (s->error || pos < s->pos || cp_pos > s->pos) {
+		stream_lzss_reset(s, cp_i < 0 ? NULL : &cp, cp_i);
+		s->pos = cp_pos;
+	}
+	const size_t n = pos - s->pos;
+	return archive_stream_skip(s, n) == n;
+}
+
+size_t archive_stream_tell(struct archive_stream *s)
+{
+	return s->pos;
+}
+
+bool archive_stream_error(struct archive_stream *s)
+{
+	return s->error;
+}
@@ -0,0 +1,146 @@
+/* Copyright (C) 2023 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "nulib.h"
+#include "ai5/arc.h"
+#include "ai5/vfs.h"
+#include "arc_internal.h"
+
+/*
+ * Values in the merged name table are (mount, entry) pairs.
+ */
+#define VFS_ENTRY_BITS 20
+#define VFS_ENTRY_MASK ((1u << VFS_ENTRY_BITS) - 1)
+#define VFS_MAX_MOUNTS (1u << (32 - VFS_ENTRY_BITS))
+
+struct archive_vfs {
+	struct archive **mounts;
+	unsigned nr_mounts;
+	struct arc_name_table table;
+	struct arc_cache_group *group;
+};
+
+struct archive_vfs *archive_vfs_new(void)
+{
+	struct archive_vfs *vfs = xcalloc(1, sizeof(struct archive_vfs));
+	vfs->group = arc_cache_group_new();
+	return vfs;
+}
+
+void archive_vfs_free(struct archive_vfs *vfs)
+{
+	for (unsigned i = 0; i < vfs->nr_mounts; i++) {
+		archive_close(vfs->mounts[i]);
+	}
+	free(vfs->mounts);
+	arc_name_table_free(&vfs->table);
+	arc_cache_group_free(vfs->group);
+	free(vfs);
+}
+
+/*
+ * Rebuild the merged name table. Names from later mounts are listed first,
+ * so that they win when duplicates are removed.
+ */
+static void vfs_rebuild(struct archive_vfs *vfs)
+{
+	unsigned n = 0;
+	for (unsigned i = 0; i < vfs->nr_mounts; i++) {
+		n += vfs->mounts[i]->meta.nr_files;
+	}
+
+	const char **names = xmalloc(max(n, 1) * sizeof(const char*));
+	uint32_t *values = xmalloc(max(n, 1) * sizeof(uint32_t));
+	unsigned k = 0;
+	for (int m = vfs->nr_mounts - 1; m >= 0; m--) {
+		struct archive *arc = vfs->mounts[m];
+		for (unsigned i = 0; i < arc->meta.nr_files; i++) {
+			names[k] = arc_index_name(arc, i);
+			values[k] = ((uint32_t)m << VFS_ENTRY_BITS) | i;
+			k++;
+		}
+	}
+	n = arc_name_dedup(names, values, n);
+
+	arc_name_table_free(&vfs->table);
+	arc_name_table_build_keys(&vfs->table, names, values, n);
+	free(values);
+	free(names);
+}
+
+void archive_vfs_mount(struct archive_vfs *vfs, struct archive *arc)
+{
+	if (vfs->nr_mounts >= VFS_MAX_MOUNTS)
+		ERROR("too many archives mounted");
+	if (arc->meta.nr_files > VFS_ENTRY_MASK + 1)
+		ERROR("too many files in archive");
+	vfs->mounts = xrealloc(vfs->mounts, (vfs->nr_mounts + 1) * sizeof(struct archive*));
+	vfs->mounts[vfs->nr_mounts++] = arc;
+	arc_set_cache_group(arc, vfs->group);
+	vfs_rebuild(vfs);
+}
+
+struct archive *archive_vfs_mount_path(struct archive_vfs *vfs, const char *path,
+		unsigned flags)
+{
+	struct archive *arc = archive_open(path, flags);
+	if (!arc)
+		return NULL;
+	archive_vfs_mount(vfs, arc);
+	return arc;
+}
+
+bool archive_vfs_unmount(struct archive_vfs *vfs, struct archive *arc)
+{
+	for (unsigned i = 0; i < vfs->nr_mounts; i++) {
+		if (vfs->mounts[i] != arc)
+			continue;
+		memmove(vfs->mounts + i, vfs->mounts + i + 1,
+				(vfs->nr_mounts - i - 1) * sizeof(struct archive*));
+		vfs->nr_mounts--;
+		arc_set_cache_group(arc, NULL);
+		vfs_rebuild(vfs);
+		return true;
+	}
+	return false;
+}
+
+struct archive_data *archive_vfs_entry(struct archive_vfs *vfs, const char *name)
+{
+	uint32_t v;
+	if (!arc_name_table_probe(&vfs->table, name, &v))
+		return NULL;
+	struct archive *arc = vfs->mounts[v >> VFS_ENTRY_BITS];
+	unsigned i = v & VFS_ENTRY_MASK;
+	if (!arc_name_equal(name, arc_index_name(arc, i)))
+		return NULL;
+	return archive_entry(arc, i);
+}
+
+struct archive_data *archive_vfs_get(struct archive_vfs *vfs, const char *name)
+{
+	struct archive_data *data = archive_vfs_entry(vfs, name);
+	if (data && archive_data_load(data))
+		return data;
+	return NULL;
+}
+
+void archive_vfs_set_cache_limit(struct archive_vfs *vfs, size_t bytes)
+{
+	arc_cache_group_set_limit(vfs->group, bytes);
+}
@@ -0,0 +1,498 @@
+/* Copyright (C) 2023 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "nulib.h"
+#include "nulib/file.h"
+#include "nulib/little_endian.h"
+#include "nulib/string.h"
+#include "nulib/utfsjis.h"
+#include "nulib/vector.h"
+#include "ai5/arc.h"
+#include "ai5/game.h"
+#include "ai5/lzss.h"
+#include "arc_internal.h"
+
+struct writer_entry {
+	string name;
+	uint8_t *data;
+	size_t size;
+	struct awd_file_metadata awd;
+	// output of compression (may be `data`)
+	uint8_t *out;
+	size_t out_size;
+	uint32_t offset;
+};
+
+struct archive_writer {
+	struct arc_metadata meta;
+	unsigned flags;
+	vector_t(struct writer_entry) entries;
+	atomic_uint next;
+};
+
+void archive_writer_default_metadata(enum archive_type type, struct arc_metadata *meta)
+{
+	memset(meta, 0, sizeof(struct arc_metadata));
+	meta->type = type;
+	meta->scheme = ARCHIVE_SCHEME_TYPICAL;
+	switch (type) {
+	case ARCHIVE_TYPE_ARC:
+		// the reader assumes the game-specific index for these games
+		if (arc_game_specific_metadata(meta))
+			break;
+		// name / offset / size
+		meta->index_off = 4;
+		meta->name_length = 0x20;
+		meta->entry_size = 0x28;
+		meta->name_off = 0;
+		meta->offset_off = 0x20;
+		meta->size_off = 0x24;
+		break;
+	case ARCHIVE_TYPE_DAT:
+		meta->index_off = 8;
+		meta->entry_size = 28;
+		meta->name_length = 20;
+		meta->offset_off = 4;
+		meta->size_off = 0;
+		meta->name_off = 8;
+		break;
+	case ARCHIVE_TYPE_AWD:
+		meta->index_off = 4;
+		meta->entry_size = 38;
+		meta->name_length = 16;
+		meta->name_off = 0;
+		meta->offset_off = 18;
+		meta->size_off = 22;
+		meta->awd_type_off = 16;
+		meta->loop_start_off = 26;
+		meta->loop_end_off = 30;
+		break;
+	case ARCHIVE_TYPE_AWF:
+		meta->index_off = 4;
+		meta->entry_size = 52;
+		meta->name_length = 32;
+		meta->name_off = 0;
+		meta->offset_off = 32;
+		meta->size_off = 36;
+		meta->loop_start_off = 40;
+		meta->loop_end_off = 44;
+		break;
+	}
+}
+
+static bool field_fits(const struct arc_metadata *meta, uint32_t off, uint32_t size,
+		const char *field)
+{
+	if (off > meta->entry_size || size > meta->entry_size - off) {
+		WARNING("%s field does not fit in %u byte index entry", field, meta->entry_size);
+		return false;
+	}
+	return true;
+}
+
+static bool writer_check_metadata(struct arc_metadata *meta)
+{
+	if (meta->type == ARCHIVE_TYPE_ARC) {
+		// the game-specific layout is fixed, and is the one the reader
+		// will assume for the target game
+		if (arc_game_specific_metadata(meta))
+			return true;
+		if (meta->scheme == ARCHIVE_SCHEME_GAME_SPECIFIC) {
+			WARNING("Game-specific archive type but no game specified");
+			return false;
+		}
+	} else if (meta->scheme != ARCHIVE_SCHEME_TYPICAL) {
+		WARNING("Game-specific scheme is only supported for ARC archives");
+		return false;
+	}
+
+	if (meta->index_off < (meta->type == ARCHIVE_TYPE_DAT ? 8 : 4)) {
+		WARNING("index overlaps archive header");
+		return false;
+	}
+	if (!meta->name_length) {
+		WARNING("zero-length name field");
+		return false;
+	}
+	if (!field_fits(meta, meta->name_off, meta->name_length, "name")
+			|| !field_fits(meta, meta->offset_off, 4, "offset")
+			|| !field_fits(meta, meta->size_off, 4, "size"))
+		return false;
+	if (meta->type == ARCHIVE_TYPE_AWD && !field_fits(meta, meta->awd_type_off, 2, "type"))
+		return false;
+	if (meta->type == ARCHIVE_TYPE_AWD || meta->type == ARCHIVE_TYPE_AWF) {
+		if (!field_fits(meta, meta->loop_start_off, 4, "loop start")
+				|| !field_fits(meta, meta->loop_end_off, 4, "loop end"))
+			return false;
+	}
+	return true;
+}
+
+struct archive_writer *archive_writer_new(const struct arc_metadata *meta, unsigned flags)
+{
+	struct arc_metadata m = *meta;
+	if (!writer_check_metadata(&m))
+		return NULL;
+
+	struct archive_writer *w = xcalloc(1, sizeof(struct archive_writer));
+	w->meta = m;
+	w->flags = flags;
+	vector_init(w->entries);
+	return w;
+}
+
+void archive_writer_free(struct archive_writer *w)
+{
+	struct writer_entry *e;
+	vector_foreach_p(e, w->entries) {
+		if (e->out != e->data)
+			free(e->out);
+		free(e->data);
+		string_free(e->name);
+	}
+	vector_destroy(w->entries);
+	free(w);
+}
+
+/*
+ * Get the PCM data from a WAV file. Returns false if the data is not a WAV
+ * file (in which case it is taken to be raw PCM).
+ */
+static bool wav_get_pcm(const uint8_t *data, size_t size, size_t *off, size_t *pcm_size)
+{
+	if (size < 12 || memcmp(data, "RIFF", 4) || memcmp(data + 8, "WAVE", 4))
+		return false;
+	size_t pos = 12;
+	while (size - pos >= 8) {
+		uint32_t chunk_size = le_get32(data, pos + 4);
+		if (!memcmp(data + pos, "data", 4)) {
+			*off = pos + 8;
+			*pcm_size = min(chunk_size, size - (pos + 8));
+			return true;
+		}
+		if (chunk_size > size - (pos + 8))
+			break;
+		pos += 8 + chunk_size + (chunk_size & 1);
+	}
+	return false;
+}
+
+void archive_writer_add(struct archive_writer *w, const char *name, const uint8_t *data,
+		size_t size, const struct awd_file_metadata *awd)
+{
+	struct writer_entry e = {
+		.name = string_new(name),
+		.awd = { .type = AWD_PCM },
+	};
+	if (awd)
+		e.awd = *awd;
+
+	size_t off = 0;
+	if ((w->meta.type == ARCHIVE_TYPE_AWD || w->meta.type == ARCHIVE_TYPE_AWF)
+			&& e.awd.type == AWD_PCM)
+		wav_get_pcm(data, size, &off, &size);
+
+	e.data = xmalloc(max(size, 1));
+	memcpy(e.data, data + off, size);
+	e.size = size;
+	vector_push(struct writer_entry, w->entries, e);
+}
+
+static void writer_compress(struct archive_writer *w, struct writer_entry *e)
+{
+	if (w->meta.type == ARCHIVE_TYPE_AWD || w->meta.type == ARCHIVE_TYPE_AWF
+			|| (w->flags & ARCHIVE_RAW)) {
+		e->out = e->data;
+		e->out_size = e->size;
+	} else if (game_is_aiwin()) {
+		e->out = lzss_bw_compress(e->data, e->size, &e->out_size);
+	} else {
+		e->out = lzss_compress(e->data, e->size, &e->out_size);
+	}
+}
+
+static void *writer_worker(void *_w)
+{
+	struct archive_writer *w = _w;
+	unsigned i;
+	while ((i = atomic_fetch_add(&w->next, 1)) < vector_length(w->entries)) {
+		writer_compress(w, &vector_A(w->entries, i));
+	}
+	return NULL;
+}
+
+static void writer_compress_all(struct archive_writer *w, unsigned nr_threads)
+{
+	const unsigned nr_entries = vector_length(w->entries);
+	if (!nr_threads)
+		nr_threads = arc_nr_processors();
+	nr_threads = max(min(nr_threads, nr_entries), 1);
+
+	atomic_store(&w->next, 0);
+	pthread_t *threads = xcalloc(nr_threads, sizeof(pthread_t));
+	unsigned nr_started = 0;
+	for (; nr_started < nr_threads - 1; nr_started++) {
+		if (pthread_create(&threads[nr_started], NULL, writer_worker, w))
+			break;
+	}
+	writer_worker(w);
+	for (unsigned i = 0; i < nr_started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	free(threads);
+}
+
+/*
+ * Index encoders.
+ */
+
+static bool typical_write_entry(struct archive_writer *w, struct writer_entry *e, uint8_t *buf)
+{
+	const struct arc_metadata *meta = &w->meta;
+	const size_t name_len = strlen(e->name);
+	// names are null-terminated (the terminator reveals the name key)
+	if (name_len >= meta->name_length) {
+		WARNING("file name too long: %s", e->name);
+		return false;
+	}
+	uint8_t *name = buf + meta->name_off;
+	memcpy(name, e->name, name_len);
+	for (unsigned i = 0; i < meta->name_length; i++) {
+		name[i] ^= meta->name_key;
+	}
+	le_put32(buf, meta->offset_off, e->offset ^ meta->offset_key);
+	le_put32(buf, meta->size_off, e->out_size ^ meta->size_key);
+
+	if (meta->type == ARCHIVE_TYPE_AWD) {
+		le_put16(buf, meta->awd_type_off, e->awd.type);
+		le_put32(buf, meta->loop_start_off, e->awd.loop_start);
+		le_put32(buf, meta->loop_end_off, e->awd.loop_end);
+	} else if (meta->type == ARCHIVE_TYPE_AWF) {
+		le_put32(buf, meta->loop_start_off, e->awd.loop_start);
+		le_put32(buf, meta->loop_end_off, e->awd.loop_end);
+	}
+	return true;
+}
+
+/*
+ * Convert a name to Shift-JIS for game-specific indices. Returns NULL if it
+ * does not fit in `max_len` bytes (including the terminator).
+ */
+static char *sjis_name(struct writer_entry *e, size_t max_len)
+{
+	char *sjis = utf8_cstring_to_sjis(e->name, 0);
+	if (strlen(sjis) >= max_len) {
+		WARNING("file name too long: %s", e->name);
+		free(sjis);
+		return NULL;
+	}
+	return sjis;
+}
+
+static bool doukyuusei_2_dl_write_entry(struct archive_writer *w, struct writer_entry *e,
+		uint8_t *entry)
+{
+	char *name = sjis_name(e, 31);
+	if (!name)
+		return false;
+	le_put32(entry, 0, e->offset);
+	le_put32(entry, 4, e->out_size);
+	memcpy(entry + 8, name, strlen(name));
+	free(name);
+
+	// invert the substitution in doukyuusei_2_dl_read_entry
+	uint8_t inv[256];
+	for (int i = 0; i < 256; i++) {
+		inv[arc_doukyuusei_2_dl_sbox[i]] = i;
+	}
+	for (int i = 0; i < 39; i++) {
+		entry[i] = (uint8_t)41 - inv[entry[i]];
+	}
+	return true;
+}
+
+static bool kakyuusei_write_index(struct archive_writer *w, uint8_t *buf)
+{
+	static const uint8_t shuffle_table[20] = {
+		17, 2, 8, 19, 0, 5, 10, 13, 1, 15, 6, 4, 11, 16, 3, 9, 18, 12, 7, 14
+	};
+
+	uint8_t dec[20];
+	uint8_t key = vector_length(w->entries);
+	struct writer_entry *e;
+	vector_foreach_p(e, w->entries) {
+		// NOTE: the name field has no room for a terminator
+		char *name = sjis_name(e, 13);
+		if (!name)
+			return false;
+		memset(dec, 0, 20);
+		memcpy(dec, name, strlen(name));
+		free(name);
+		le_put32(dec, 12, e->out_size);
+		le_put32(dec, 16, e->offset);
+		for (int i = 0; i < 20; i++) {
+			buf[i] = dec[shuffle_table[i]] ^ key;
+			key = ((int)key * 3 + 1) & 0xff;
+		}
+		buf += 20;
+	}
+	return true;
+}
+
+static bool kisaku_anim_write_entry(struct archive_writer *w, struct writer_entry *e,
+		uint8_t *entry)
+{
+	char *name = sjis_name(e, 260);
+	if (!name)
+		return false;
+	int name_len = strlen(name);
+	for (int i = 0, key = name_len + 1; i < name_len; i++, key--) {
+		entry[i] = (uint8_t)name[i] + key;
+		if (!entry[i]) {
+			// would terminate the name early
+			WARNING("file name cannot be encoded: %s", e->name);
+			free(name);
+			return false;
+		}
+	}
+	free(name);
+	// big endian
+	for (int i = 0; i < 4; i++) {
+		entry[260 + i] = e->out_size >> (24 - i * 8);
+		entry[268 + i] = e->offset >> (24 - i * 8);
+	}
+	return true;
+}
+
+static bool writer_encode_index(struct archive_writer *w, uint8_t *buf)
+{
+	const struct arc_metadata *meta = &w->meta;
+	const uint32_t nr_files = vector_length(w->entries);
+	bool(*write_entry)(struct archive_writer*,struct writer_entry*,uint8_t*) = typical_write_entry;
+
+	if (meta->type == ARCHIVE_TYPE_DAT) {
+		le_put32(buf, 0, nr_files ^ meta->offset_key);
+		le_put32(buf, 4, meta->offset_key);
+	} else {
+		le_put32(buf, 0, nr_files);
+	}
+
+	if (meta->scheme == ARCHIVE_SCHEME_GAME_SPECIFIC) {
+		switch (ai5_target_game) {
+		case GAME_DOUKYUUSEI2_DL:
+			write_entry = doukyuusei_2_dl_write_entry;
+			break;
+		case GAME_KAKYUUSEI:
+			return kakyuusei_write_index(w, buf + meta->index_off);
+		case GAME_KISAKU_ANIM:
+			write_entry = kisaku_anim_write_entry;
+			break;
+		default:
+			WARNING("Game-specific archive type but no game specified");
+			return false;
+		}
+	}
+
+	uint8_t *entry = buf + meta->index_off;
+	struct writer_entry *e;
+	vector_foreach_p(e, w->entries) {
+		if (!write_entry(w, e, entry))
+			return false;
+		entry += meta->entry_size;
+	}
+	return true;
+}
+
+bool archive_writer_write(struct archive_writer *w, const char *path, unsigned nr_threads)
+{
+	struct arc_metadata *meta = &w->meta;
+	const uint32_t nr_files = vector_length(w->entries);
+	if (meta->type == ARCHIVE_TYPE_DAT && meta->size_key != meta->offset_key) {
+		WARNING("DAT archives use the same key for offsets and sizes");
+		return false;
+	}
+
+	writer_compress_all(w, nr_threads);
+
+	// lay out payloads directly after the index, in index order
+	uint32_t header_size = meta->index_off + nr_files * meta->entry_size;
+	uint32_t pos = header_size;
+	if (meta->type == ARCHIVE_TYPE_AWD && meta->scheme == ARCHIVE_SCHEME_TYPICAL) {
+		// The older AWD format is detected by bytes 18-19 of the first
+		// entry being zero. In that format they are padding (left zero
+		// here); in the newer format they are the lower half of the first
+		// offset, so it must not be a multiple of 0x10000.
+		if (meta->offset_off == 18 && nr_files && !(pos & 0xffff))
+			pos += 2;
+	}
+	const uint32_t pad_before = pos - header_size;
+	struct writer_entry *e;
+	vector_foreach_p(e, w->entries) {
+		if ((uint64_t)pos + e->out_size > UINT32_MAX) {
+			WARNING("archive too large");
+			return false;
+		}
+		e->offset = pos;
+		pos += e->out_size;
+	}
+
+	// Detection of typical ARC ciphers reads the first 0x318 bytes of the
+	// index and requires the third entry to end before the end of file.
+	uint32_t pad_after = 0;
+	if (meta->type == ARCHIVE_TYPE_ARC && meta->scheme == ARCHIVE_SCHEME_TYPICAL) {
+		if (nr_files < 3)
+			WARNING("ARC archives with fewer than 3 files cannot be detected");
+		pad_after = max(pos + 1, 4 + 0x318) - pos;
+	}
+
+	uint8_t *header = xcalloc(1, header_size + pad_before);
+	if (!writer_encode_index(w, header)) {
+		free(header);
+		return false;
+	}
+
+	FILE *fp = file_open_utf8(path, "wb");
+	if (!fp) {
+		WARNING("file_open_utf8: %s", strerror(errno));
+		free(header);
+		return false;
+	}
+	bool ok = fwrite(header, header_size + pad_before, 1, fp) == 1;
+	free(header);
+	vector_foreach_p(e, w->entries) {
+		if (!ok)
+			break;
+		if (e->out_size && fwrite(e->out, e->out_size, 1, fp) != 1)
+			ok = false;
+	}
+	for (uint32_t i = 0; ok && i < pad_after; i++) {
+		if (fputc(0, fp) == EOF)
+			ok = false;
+	}
+	if (!ok)
+		WARNING("fwrite: %s", strerror(errno));
+	if (fclose(fp)) {
+		WARNING("fclose: %s", strerror(errno));
+		ok = false;
+	}
+	return ok;
+}
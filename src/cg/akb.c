@@ -45,8 +45,9 @@ struct cg *akb_decode(uint8_t *data, size_t size)
 	}
 
 	// decompress
-	size_t decomp_size;
-	uint8_t *decomp = lzss_decompress(data + 32, size - 32, &decomp_size);
+	const size_t px_size = cg->metrics.w * cg->metrics.h * ((flags & FLAG_NO_ALPHA) ? 3 : 4);
+	uint8_t *decomp = xmalloc(px_size);
+	size_t decomp_size = lzss_decompress_into(data + 32, size - 32, decomp, px_size);
 	if (flags & FLAG_NO_ALPHA) {
 		// RGB
 		if (decomp_size < cg->metrics.w * cg->metrics.h * 3) {
@@ -0,0 +1,396 @@
+/* Copyright (C) 2023 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#include <stdatomic.h>
+
+#include "nulib.h"
+#include "nulib/little_endian.h"
+#include "ai5/cg.h"
+
+/*
+ * Pixel format conversion kernels.
+ *
+ * Each kernel converts `w` pixels of one row. The scalar kernels are the
+ * reference; the SIMD kernels convert as many pixels as they can without
+ * reading or writing outside of the row, and hand the rest to the scalar
+ * kernel. The best set of kernels supported by the CPU is selected on first
+ * use.
+ */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CONVERT_X86
+#include <immintrin.h>
+#endif
+
+typedef void (*convert_fn)(uint8_t *dst, const uint8_t *src, unsigned w);
+
+struct convert_ops {
+	convert_fn bgr555_to_rgba;
+	convert_fn bgr_to_rgba;
+	convert_fn bgra_to_rgba;
+	convert_fn rgba_to_bgr555;
+	convert_fn rgba_to_bgr;
+	convert_fn rgba_to_bgra;
+};
+
+static void bgr555_to_rgba_scalar(uint8_t *dst, const uint8_t *src, unsigned w)
+{
+	for (unsigned col = 0; col < w; col++) {
+		uint16_t c = le_get16(src, col * 2);
+		*dst++ = (c & 0x7c00) >> 7;
+		*dst++ = (c & 0x03e0) >> 2;
+		*dst++ = (c & 0x001f) << 3;
+		*dst++ = 0xff;
+	}
+}
+
+static void bgr_to_rgba_scalar(uint8_t *dst, const uint8_t *src, unsigned w)
+{
+	for (unsigned col = 0; col < w; col++, src += 3, dst += 4) {
+		dst[0] = src[2];
+		dst[1] = src[1];
+		dst[2] = src[0];
+		dst[3] = 0xff;
+	}
+}
+
+// also used for RGBA -> BGRA, which is the same swap
+static void bgra_to_rgba_scalar(uint8_t *dst, const uint8_t *src, unsigned w)
+{
+	for (unsigned col = 0; col < w; col++, src += 4, dst += 4) {
+		dst[0] = src[2];
+		dst[1] = src[1];
+		dst[2] = src[0];
+		dst[3] = src[3];
+	}
+}
+
+static void rgba_to_bgr555_scalar(uint8_t *dst, const uint8_t *src, unsigned w)
+{
+	for (unsigned col = 0; col < w; col++, src += 4) {
+		uint16_t c = 0;
+		c |= (src[0] & 0xf8) << 7;
+		c |= (src[1] & 0xf8) << 2;
+		c |= (src[2] & 0xf8) >> 3;
+		le_put16(dst, col * 2, c);
+	}
+}
+
+static void rgba_to_bgr_scalar(uint8_t *dst, const uint8_t *src, unsigned w)
+{
+	for (unsigned col = 0; col < w; col++, src += 4, dst += 3) {
+		dst[0] = src[2];
+		dst[1] = src[1];
+		dst[2] = src[0];
+	}
+}
+
+static const struct convert_ops scalar_ops = {
+	.bgr555_to_rgba = bgr555_to_rgba_scalar,
+	.bgr_to_rgba = bgr_to_rgba_scalar,
+	.bgra_to_rgba = bgra_to_rgba_scalar,
+	.rgba_to_bgr555 = rgba_to_bgr555_scalar,
+	.rgba_to_bgr = rgba_to_bgr_scalar,
+	.rgba_to_bgra = bgra_to_rgba_scalar,
+};
+
+#ifdef CONVERT_X86
+
+/*
+ * SSE2: BGR555 pixels are widened to 32 bits and their fields shifted into
+ * place; the R/B swap is done with masks and shifts. There is no byte
+ * shuffle, so 24-bit formats are left to the scalar kernels.
+ */
+
+__attribute__((target("sse2")))
+static void bgr555_to_rgba_sse2(uint8_t *dst, const uint8_t *src, unsigned w)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i alpha = _mm_set1_epi32(0xff000000);
+	const __m128i r_mask = _mm_set1_epi32(0x0000f8);
+	const __m128i g_mask = _mm_set1_epi32(0x00f800);
+	const __m128i b_mask = _mm_set1_epi32(0xf80000);
+	unsigned col = 0;
+	for (; col + 8 <= w; col += 8) {
+		__m128i c = _mm_loadu_si128((const __m128i*)(src + col * 2));
+		__m128i c_lo = _mm_unpacklo_epi16(c, zero);
+		__m128i c_hi = _mm_unpackhi_epi16(c, zero);
+		#define BGR555_TO_RGBA(c) \
+			_mm_or_si128(_mm_or_si128( \
+				_mm_and_si128(_mm_srli_epi32(c, 7), r_mask), \
+				_mm_and_si128(_mm_slli_epi32(c, 6), g_mask)), \
+				_mm_or_si128(_mm_and_si128(_mm_slli_epi32(c, 19), b_mask), alpha))
+		_mm_storeu_si128((__m128i*)(dst + col * 4), BGR555_TO_RGBA(c_lo));
+		_mm_storeu_si128((__m128i*)(dst + col * 4 + 16), BGR555_TO_RGBA(c_hi));
+		#undef BGR555_TO_RGBA
+	}
+	bgr555_to_rgba_scalar(dst + col * 4, src + col * 2, w - col);
+}
+
+__attribute__((target("sse2")))
+static void bgra_to_rgba_sse2(uint8_t *dst, const uint8_t *src, unsigned w)
+{
+	const __m128i ga_mask = _mm_set1_epi32(0xff00ff00);
+	const __m128i rb_mask = _mm_set1_epi32(0x000000ff);
+	unsigned col = 0;
+	for (; col + 4 <= w; col += 4) {
+		__m128i c = _mm_loadu_si128((const __m128i*)(src + col * 4));
+		__m128i ga = _mm_and_si128(c, ga_mask);
+		__m128i r = _mm_and_si128(_mm_srli_epi32(c, 16), rb_mask);
+		__m128i b = _mm_slli_epi32(_mm_and_si128(c, rb_mask), 16);
+		_mm_storeu_si128((__m128i*)(dst + col * 4), _mm_or_si128(ga, _mm_or_si128(r, b)));
+	}
+	bgra_to_rgba_scalar(dst + col * 4, src + col * 4, w - col);
+}
+
+__attribute__((target("sse2")))
+static void rgba_to_bgr555_sse2(uint8_t *dst, const uint8_t *src, unsigned w)
+{
+	const __m128i r_mask = _mm_set1_epi32(0x0000f8);
+	const __m128i g_mask = _mm_set1_epi32(0x00f800);
+	const __m128i b_mask = _mm_set1_epi32(0xf80000);
+	unsigned col = 0;
+	for (; col + 8 <= w; col += 8) {
+		__m128i c_lo = _mm_loadu_si128((const __m128i*)(src + col * 4));
+		__m128i c_hi = _mm_loadu_si128((const __m128i*)(src + col * 4 + 16));
+		#define RGBA_TO_BGR555(c) \
+			_mm_or_si128(_mm_or_si128( \
+				_mm_slli_epi32(_mm_and_si128(c, r_mask), 7), \
+				_mm_srli_epi32(_mm_and_si128(c, g_mask), 6)), \
+				_mm_srli_epi32(_mm_and_si128(c, b_mask), 19))
+		// values fit in 15 bits, so the signed pack doesn't saturate
+		__m128i c = _mm_packs_epi32(RGBA_TO_BGR555(c_lo), RGBA_TO_BGR555(c_hi));
+		#undef RGBA_TO_BGR555
+		_mm_storeu_si128((__m128i*)(dst + col * 2), c);
+	}
+	rgba_to_bgr555_scalar(dst + col * 2, src + col * 4, w - col);
+}
+
+static const struct convert_ops sse2_ops = {
+	.bgr555_to_rgba = bgr555_to_rgba_sse2,
+	.bgr_to_rgba = bgr_to_rgba_scalar,
+	.bgra_to_rgba = bgra_to_rgba_sse2,
+	.rgba_to_bgr555 = rgba_to_bgr555_sse2,
+	.rgba_to_bgr = rgba_to_bgr_scalar,
+	.rgba_to_bgra = bgra_to_rgba_sse2,
+};
+
+/*
+ * SSSE3: byte shuffles for the 24-bit formats and the R/B swap. Four 24-bit
+ * pixels are 12 bytes, but loads (bgr_to_rgba) and stores (rgba_to_bgr) are
+ * 16 bytes wide, so the loop stops while 16 bytes still fit in the row. The
+ * extra 4 bytes stored are overwritten by the next store.
+ */
+
+#define BGR_TO_RGBA_SHUFFLE \
+	2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1
+#define RGBA_TO_BGR_SHUFFLE \
+	2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1
+#define BGRA_TO_RGBA_SHUFFLE \
+	2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15
+
+__attribute__((target("ssse3")))
+static void bgr_to_rgba_ssse3(uint8_t *dst, const uint8_t *src, unsigned w)
+{
+	const __m128i shuf = _mm_setr_epi8(BGR_TO_RGBA_SHUFFLE);
+	const __m128i alpha = _mm_set1_epi32(0xff000000);
+	unsigned col = 0;
+	for (; col + 6 <= w; col += 4) {
+		__m128i c = _mm_loadu_si128((const __m128i*)(src + col * 3));
+		c = _mm_or_si128(_mm_shuffle_epi8(c, shuf), alpha);
+		_mm_storeu_si128((__m128i*)(dst + col * 4), c);
+	}
+	bgr_to_rgba_scalar(dst + col * 4, src + col * 3, w - col);
+}
+
+__attribute__((target("ssse3")))
+static void bgra_to_rgba_ssse3(uint8_t *dst, const uint8_t *src, unsigned w)
+{
+	const __m128i shuf = _mm_setr_epi8(BGRA_TO_RGBA_SHUFFLE);
+	unsigned col = 0;
+	for (; col + 4 <= w; col += 4) {
+		__m128i c = _mm_loadu_si128((const __m128i*)(src + col * 4));
+		_mm_storeu_si128((__m128i*)(dst + col * 4), _mm_shuffle_epi8(c, shuf));
+	}
+	bgra_to_rgba_scalar(dst + col * 4, src + col * 4, w - col);
+}
+
+__attribute__((target("ssse3")))
+static void rgba_to_bgr_ssse3(uint8_t *dst, const uint8_t *src, unsigned w)
+{
+	const __m128i shuf = _mm_setr_epi8(RGBA_TO_BGR_SHUFFLE);
+	unsigned col = 0;
+	for (; col + 6 <= w; col += 4) {
+		__m128i c = _mm_loadu_si128((const __m128i*)(src + col * 4));
+		_mm_storeu_si128((__m128i*)(dst + col * 3), _mm_shuffle_epi8(c, shuf));
+	}
+	rgba_to_bgr_scalar(dst + col * 3, src + col * 4, w - col);
+}
+
+static const struct convert_ops ssse3_ops = {
+	.bgr555_to_rgba = bgr555_to_rgba_sse2,
+	.bgr_to_rgba = bgr_to_rgba_ssse3,
+	.bgra_to_rgba = bgra_to_rgba_ssse3,
+	.rgba_to_bgr555 = rgba_to_bgr555_sse2,
+	.rgba_to_bgr = rgba_to_bgr_ssse3,
+	.rgba_to_bgra = bgra_to_rgba_ssse3,
+};
+
+/*
+ * AVX2: the same operations on 256-bit vectors. Shuffles work within 128-bit
+ * lanes, so 24-bit pixels would have to be loaded and stored one lane at a
+ * time; this is slower than the SSSE3 kernels, which are used instead.
+ */
+
+__attribute__((target("avx2")))
+static void bgr555_to_rgba_avx2(uint8_t *dst, const uint8_t *src, unsigned w)
+{
+	const __m256i alpha = _mm256_set1_epi32(0xff000000);
+	const __m256i r_mask = _mm256_set1_epi32(0x0000f8);
+	const __m256i g_mask = _mm256_set1_epi32(0x00f800);
+	const __m256i b_mask = _mm256_set1_epi32(0xf80000);
+	unsigned col = 0;
+	for (; col + 8 <= w; col += 8) {
+		__m256i c = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(src + col * 2)));
+		c = _mm256_or_si256(_mm256_or_si256(
+				_mm256_and_si256(_mm256_srli_epi32(c, 7), r_mask),
+				_mm256_and_si256(_mm256_slli_epi32(c, 6), g_mask)),
+				_mm256_or_si256(_mm256_and_si256(_mm256_slli_epi32(c, 19), b_mask),
+					alpha));
+		_mm256_storeu_si256((__m256i*)(dst + col * 4), c);
+	}
+	bgr555_to_rgba_scalar(dst + col * 4, src + col * 2, w - col);
+}
+
+__attribute__((target("avx2")))
+static void bgra_to_rgba_avx2(uint8_t *dst, const uint8_t *src, unsigned w)
+{
+	const __m256i shuf = _mm256_setr_epi8(BGRA_TO_RGBA_SHUFFLE, BGRA_TO_RGBA_SHUFFLE);
+	unsigned col = 0;
+	for (; col + 8 <= w; col += 8) {
+		__m256i c = _mm256_loadu_si256((const __m256i*)(src + col * 4));
+		_mm256_storeu_si256((__m256i*)(dst + col * 4), _mm256_shuffle_epi8(c, shuf));
+	}
+	bgra_to_rgba_scalar(dst + col * 4, src + col * 4, w - col);
+}
+
+__attribute__((target("avx2")))
+static void rgba_to_bgr555_avx2(uint8_t *dst, const uint8_t *src, unsigned w)
+{
+	const __m256i r_mask = _mm256_set1_epi32(0x0000f8);
+	const __m256i g_mask = _mm256_set1_epi32(0x00f800);
+	const __m256i b_mask = _mm256_set1_epi32(0xf80000);
+	unsigned col = 0;
+	for (; col + 16 <= w; col += 16) {
+		__m256i c_lo = _mm256_loadu_si256((const __m256i*)(src + col * 4));
+		__m256i c_hi = _mm256_loadu_si256((const __m256i*)(src + col * 4 + 32));
+		#define RGBA_TO_BGR555(c) \
+			_mm256_or_si256(_mm256_or_si256( \
+				_mm256_slli_epi32(_mm256_and_si256(c, r_mask), 7), \
+				_mm256_srli_epi32(_mm256_and_si256(c, g_mask), 6)), \
+				_mm256_srli_epi32(_mm256_and_si256(c, b_mask), 19))
+		// the pack interleaves lanes; put the 64-bit quarters back in order
+		__m256i c = _mm256_packs_epi32(RGBA_TO_BGR555(c_lo), RGBA_TO_BGR555(c_hi));
+		#undef RGBA_TO_BGR555
+		c = _mm256_permute4x64_epi64(c, _MM_SHUFFLE(3, 1, 2, 0));
+		_mm256_storeu_si256((__m256i*)(dst + col * 2), c);
+	}
+	rgba_to_bgr555_sse2(dst + col * 2, src + col * 4, w - col);
+}
+
+static const struct convert_ops avx2_ops = {
+	.bgr555_to_rgba = bgr555_to_rgba_avx2,
+	.bgr_to_rgba = bgr_to_rgba_ssse3,
+	.bgra_to_rgba = bgra_to_rgba_avx2,
+	.rgba_to_bgr555 = rgba_to_bgr555_avx2,
+	.rgba_to_bgr = rgba_to_bgr_ssse3,
+	.rgba_to_bgra = bgra_to_rgba_avx2,
+};
+
+#endif // CONVERT_X86
+
+static const struct convert_ops *isa_ops(enum cg_convert_isa isa)
+{
+	switch (isa) {
+	case CG_CONVERT_SCALAR:
+		return &scalar_ops;
+#ifdef CONVERT_X86
+	case CG_CONVERT_SSE2:
+		return __builtin_cpu_supports("sse2") ? &sse2_ops : NULL;
+	case CG_CONVERT_SSSE3:
+		return __builtin_cpu_supports("ssse3") ? &ssse3_ops : NULL;
+	case CG_CONVERT_AVX2:
+		return __builtin_cpu_supports("avx2") ? &avx2_ops : NULL;
+#endif
+	default:
+		return NULL;
+	}
+}
+
+static _Atomic(const struct convert_ops*) ops;
+
+static const struct convert_ops *get_ops(void)
+{
+	// the ops tables are static, so a relaxed load is enough
+	const struct convert_ops *p = atomic_load_explicit(&ops, memory_order_relaxed);
+	if (likely(p))
+		return p;
+
+	enum cg_convert_isa isa = CG_CONVERT_AVX2;
+	while (!(p = isa_ops(isa)))
+		isa--;
+	atomic_store_explicit(&ops, p, memory_order_relaxed);
+	return p;
+}
+
+bool cg_convert_select(enum cg_convert_isa isa)
+{
+	const struct convert_ops *p = isa_ops(isa);
+	if (!p)
+		return false;
+	atomic_store_explicit(&ops, p, memory_order_relaxed);
+	return true;
+}
+
+void cg_bgr555_to_rgba(uint8_t *dst, const uint8_t *src, unsigned w)
+{
+	get_ops()->bgr555_to_rgba(dst, src, w);
+}
+
+void cg_bgr_to_rgba(uint8_t *dst, const uint8_t *src, unsigned w)
+{
+	get_ops()->bgr_to_rgba(dst, src, w);
+}
+
+void cg_bgra_to_rgba(uint8_t *dst, const uint8_t *src, unsigned w)
+{
+	get_ops()->bgra_to_rgba(dst, src, w);
+}
+
+void cg_rgba_to_bgr555(uint8_t *dst, const uint8_t *src, unsigned w)
+{
+	get_ops()->rgba_to_bgr555(dst, src, w);
+}
+
+void cg_rgba_to_bgr(uint8_t *dst, const uint8_t *src, unsigned w)
+{
+	get_ops()->rgba_to_bgr(dst, src, w);
+}
+
+void cg_rgba_to_bgra(uint8_t *dst, const uint8_t *src, unsigned w)
+{
+	get_ops()->rgba_to_bgra(dst, src, w);
+}
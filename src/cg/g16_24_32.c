@@ -28,127 +28,38 @@ static unsigned gxx_stride(struct cg_metrics *metrics)
 	return ((metrics->bpp / 8) * metrics->w + 3) & ~3;
 }
 
-static uint8_t *bgr555_to_rgba(uint8_t *data, size_t size, struct cg_metrics *metrics)
-{
-	unsigned stride = gxx_stride(metrics);
-	if (size != stride * metrics->h) {
-		WARNING("Unexpected size for CG: expected %u; got %u",
-				stride * metrics->h, (unsigned)size);
-		return NULL;
-	}
-
-	uint8_t *out = xmalloc(metrics->w * metrics->h * 4);
-	uint8_t *out_p = out;
-	for (int row = metrics->h - 1; row >= 0; row--) {
-		uint8_t *px = data + stride * row;
-		for (int col = 0; col < metrics->w; col++) {
-			uint16_t c = le_get16(px, col * 2);
-			*out_p++ = (c & 0x7c00) >> 7;
-			*out_p++ = (c & 0x03e0) >> 2;
-			*out_p++ = (c & 0x001f) << 3;
-			*out_p++ = 0xff;
-		}
-	}
-
-	return out;
-}
-
-static uint8_t *rgba_to_bgr555(uint8_t *data, struct cg_metrics *metrics)
+/*
+ * Convert RGBA pixels to a bottom-up image with padded rows.
+ */
+static uint8_t *rgba_to_gxx(uint8_t *data, struct cg_metrics *metrics,
+		void (*convert)(uint8_t *dst, const uint8_t *src, unsigned w))
 {
 	unsigned stride = gxx_stride(metrics);
 	uint8_t *out = xcalloc(metrics->h, stride);
 	for (int row = metrics->h - 1; row >= 0; row--) {
-		uint8_t *out_p = out + stride * row;
-		for (int col = 0; col < metrics->w; col++) {
-			uint16_t c = 0;
-			c |= (*data++ & 0xf8) << 7;
-			c |= (*data++ & 0xf8) << 2;
-			c |= (*data++ & 0xf8) >> 3;
-			data++; // drop alpha
-			le_put16(out_p, col * 2, c);
-		}
-	}
-	return out;
-}
-
-static uint8_t *bgr_to_rgba(uint8_t *data, size_t size, struct cg_metrics *metrics)
-{
-	unsigned stride = gxx_stride(metrics);
-	if (size != stride * metrics->h) {
-		WARNING("Unexpected size for CG: expected %u; got %u",
-				stride * metrics->h, (unsigned)size);
-		return NULL;
-	}
-
-	uint8_t *out = xmalloc(metrics->w * metrics->h * 4);
-	uint8_t *out_p = out;
-	for (int row = metrics->h - 1; row >= 0; row--) {
-		uint8_t *px = data + stride * row;
-		for (int col = 0; col < metrics->w; col++) {
-			*out_p++ = px[col * 3 + 2];
-			*out_p++ = px[col * 3 + 1];
-			*out_p++ = px[col * 3 + 0];
-			*out_p++ = 0xff;
-		}
-	}
-
-	return out;
-}
-
-static uint8_t *rgba_to_bgr(uint8_t *data, struct cg_metrics *metrics)
-{
-	unsigned stride = gxx_stride(metrics);
-	uint8_t *out = xmalloc(metrics->h * stride);
-	for (int row = metrics->h - 1; row >= 0; row--) {
-		uint8_t *out_p = out + stride * row;
-		for (int col = 0; col < metrics->w; col++) {
-			out_p[col * 3 + 2] = *data++;
-			out_p[col * 3 + 1] = *data++;
-			out_p[col * 3 + 0] = *data++;
-			data++; // drop alpha
-		}
+		convert(out + stride * row, data, metrics->w);
+		data += metrics->w * 4;
 	}
 	return out;
 }
 
-static uint8_t *bgra_to_rgba(uint8_t *data, size_t size, struct cg_metrics *metrics)
-{
-	unsigned stride = gxx_stride(metrics);
-	if (size != stride * metrics->h) {
-		WARNING("Unexpected size for CG: expected %u; got %u",
-				stride * metrics->h, (unsigned)size);
-		return NULL;
-	}
-
-	uint8_t *out = xmalloc(metrics->w * metrics->h * 4);
-	uint8_t *out_p = out;
-	for (int row = metrics->h - 1; row >= 0; row--) {
-		uint8_t *px = data + stride * row;
-		for (int col = 0; col < metrics->w; col++) {
-			*out_p++ = px[col * 4 + 2];
-			*out_p++ = px[col * 4 + 1];
-			*out_p++ = px[col * 4 + 0];
-			*out_p++ = px[col * 4 + 3];;
-		}
-	}
-
-	return out;
-}
+/*
+ * Rows are stored bottom-up; each row is converted into its place in the
+ * output as soon as it has been decompressed.
+ */
+struct gxx_rows {
+	struct cg_metrics *metrics;
+	uint8_t *pixels;
+	void (*convert)(uint8_t *dst, const uint8_t *src, unsigned w);
+};
 
-static uint8_t *rgba_to_bgra(uint8_t *data, struct cg_metrics *metrics)
+static void gxx_decode_row(void *user, unsigned row, const uint8_t *data)
 {
-	unsigned stride = gxx_stride(metrics);
-	uint8_t *out = xmalloc(metrics->h * stride);
-	for (int row = metrics->h - 1; row >= 0; row--) {
-		uint8_t *out_p = out + stride * row;
-		for (int col = 0; col < metrics->w; col++) {
-			out_p[col * 4 + 2] = *data++;
-			out_p[col * 4 + 1] = *data++;
-			out_p[col * 4 + 0] = *data++;
-			out_p[col * 4 + 3] = *data++;
-		}
-	}
-	return out;
+	struct gxx_rows *r = user;
+	if (row >= r->metrics->h)
+		return;
+	unsigned dst_row = r->metrics->h - (row + 1);
+	r->convert(r->pixels + dst_row * r->metrics->w * 4, data, r->metrics->w);
 }
 
 struct cg *gxx_decode(uint8_t *data, size_t size, unsigned bpp)
@@ -161,23 +72,30 @@ struct cg *gxx_decode(uint8_t *data, size_t size, unsigned bpp)
 	cg->metrics.bpp = bpp;
 	cg->metrics.has_alpha = false;
 
-	size_t px_size = cg->metrics.w * cg->metrics.h * (bpp / 8);
-	uint8_t *px_data = lzss_decompress(data+8, size-8, &px_size);
-
+	struct gxx_rows r = { .metrics = &cg->metrics };
 	if (bpp == 16)
-		cg->pixels = bgr555_to_rgba(px_data, px_size, &cg->metrics);
+		r.convert = cg_bgr555_to_rgba;
 	else if (bpp == 24)
-		cg->pixels = bgr_to_rgba(px_data, px_size, &cg->metrics);
+		r.convert = cg_bgr_to_rgba;
 	else if (bpp == 32)
-		cg->pixels = bgra_to_rgba(px_data, px_size, &cg->metrics);
+		r.convert = cg_bgra_to_rgba;
 	else
 		ERROR("unsupported bpp: %u", bpp);
 
-	free(px_data);
-	if (!cg->pixels) {
+	// one byte of slack so that oversized data is still detected (and rejected)
+	const unsigned stride = gxx_stride(&cg->metrics);
+	const size_t px_size = stride * cg->metrics.h;
+	r.pixels = xmalloc(max(cg->metrics.w * cg->metrics.h * 4, 1));
+	size_t decomp_size = lzss_decompress_rows(data+8, size-8, stride, px_size + 1,
+			gxx_decode_row, &r);
+	if (decomp_size != px_size) {
+		WARNING("Unexpected size for CG: expected %u; got %u",
+				(unsigned)px_size, (unsigned)decomp_size);
+		free(r.pixels);
 		free(cg);
 		return NULL;
 	}
+	cg->pixels = r.pixels;
 	return cg;
 }
 
@@ -199,11 +117,11 @@ bool gxx_write(struct cg *cg, FILE *out, unsigned bpp)
 	metrics.bpp = bpp;
 	size_t data_size = gxx_stride(&metrics) * metrics.h;
 	if (bpp == 16)
-		data = rgba_to_bgr555(cg->pixels, &metrics);
+		data = rgba_to_gxx(cg->pixels, &metrics, cg_rgba_to_bgr555);
 	else if (bpp == 24)
-		data = rgba_to_bgr(cg->pixels, &metrics);
+		data = rgba_to_gxx(cg->pixels, &metrics, cg_rgba_to_bgr);
 	else if (bpp == 32)
-		data = rgba_to_bgra(cg->pixels, &metrics);
+		data = rgba_to_gxx(cg->pixels, &metrics, cg_rgba_to_bgra);
 	else
 		ERROR("unsupported bpp: %u", bpp);
 
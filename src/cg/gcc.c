@@ -251,18 +251,36 @@ static uint8_t *alt_unpack(struct buffer *data, int offset, size_t total)
 	return out.buf;
 }
 
-static uint8_t *lzss_unpack(struct buffer *data, int offset, size_t total)
+static void lzss_unpack_row(void *user, unsigned row, const uint8_t *data)
 {
-	size_t unpacked_size = total;
-	uint8_t *unpacked = lzss_decompress_with_limit(data->buf + offset,
-			data->size - offset, &unpacked_size);
+	struct cg *cg = user;
+	if (row >= cg->metrics.h)
+		return;
+	unsigned dst_row = cg->metrics.h - (row + 1);
+	cg_bgr_to_rgba(cg->pixels + dst_row * cg->metrics.w * 4, data, cg->metrics.w);
+}
+
+/*
+ * Decompress the color data directly into the (flipped) output.
+ */
+static void lzss_unpack(struct buffer *data, int offset, struct cg *cg)
+{
+	size_t stride = cg->metrics.w * 3;
+	size_t total = stride * cg->metrics.h;
+	size_t unpacked_size = lzss_decompress_rows(data->buf + offset, data->size - offset,
+			stride, total, lzss_unpack_row, cg);
 	if (unpacked_size != total) {
 		WARNING("unexpected unpacked size: %u (expected %u)",
 				(unsigned)unpacked_size, (unsigned)total);
-		if (unpacked_size < total)
-			unpacked = xrealloc(unpacked, total);
+		// missing rows are black
+		for (unsigned row = (unpacked_size + stride - 1) / stride; row < cg->metrics.h; row++) {
+			uint8_t *dst = cg->pixels + (cg->metrics.h - (row + 1)) * cg->metrics.w * 4;
+			for (unsigned col = 0; col < cg->metrics.w; col++, dst += 4) {
+				dst[0] = dst[1] = dst[2] = 0;
+				dst[3] = 255;
+			}
+		}
 	}
-	return unpacked;
 }
 
 uint8_t *unpack_alpha(struct buffer *data, unsigned *w, unsigned *h)
@@ -320,16 +338,18 @@ struct cg *gcc_decode(uint8_t *data, size_t size)
 	struct buffer data_buf;
 	buffer_init(&data_buf, data, size);
 
-	uint8_t *color;
+	cg->pixels = xmalloc(max(cg->metrics.w * cg->metrics.h * 4, 1));
+
+	uint8_t *color = NULL;
 	uint8_t *alpha = NULL;
 	unsigned alpha_w = 0;
 	unsigned alpha_h = 0;
 	switch (le_get32(data, 0)) {
 	case 0x6e343247: // G24n
-		color = lzss_unpack(&data_buf, 0x14, cg->metrics.w * cg->metrics.h * 3);
+		lzss_unpack(&data_buf, 0x14, cg);
 		break;
 	case 0x6d343247: // G24m
-		color = lzss_unpack(&data_buf, 0x20, cg->metrics.w * cg->metrics.h * 3);
+		lzss_unpack(&data_buf, 0x20, cg);
 		alpha = unpack_alpha(&data_buf, &alpha_w, &alpha_h);
 		break;
 	case 0x6e343252: // R24n
@@ -341,21 +361,16 @@ struct cg *gcc_decode(uint8_t *data, size_t size)
 		break;
 	default:
 		WARNING("unsupported CGG image type");
+		free(cg->pixels);
 		free(cg);
 		return NULL;
 	}
 
-	cg->pixels = xmalloc(cg->metrics.w * cg->metrics.h * 4);
-
-	for (int row = 0; row < cg->metrics.h; row++) {
-		int dst_row = cg->metrics.h - (row + 1);
-		uint8_t *src = color + row * cg->metrics.w * 3;
-		uint8_t *dst = cg->pixels + dst_row * cg->metrics.w * 4;
-		for (int col = 0; col < cg->metrics.w; col++, src += 3, dst += 4) {
-			dst[0] = src[2];
-			dst[1] = src[1];
-			dst[2] = src[0];
-			dst[3] = 255;
+	if (color) {
+		for (int row = 0; row < cg->metrics.h; row++) {
+			int dst_row = cg->metrics.h - (row + 1);
+			cg_bgr_to_rgba(cg->pixels + dst_row * cg->metrics.w * 4,
+					color + row * cg->metrics.w * 3, cg->metrics.w);
 		}
 	}
 
@@ -22,6 +22,15 @@
 #include "ai5/cg.h"
 #include "ai5/lzss.h"
 
+static void gp8_decode_row(void *user, unsigned row, const uint8_t *data)
+{
+	struct cg *cg = user;
+	if (row >= cg->metrics.h)
+		return;
+	uint8_t *dst = cg->pixels + cg->metrics.w * (cg->metrics.h - (row + 1));
+	memcpy(dst, data, cg->metrics.w);
+}
+
 struct cg *gp8_decode(uint8_t *data, size_t size)
 {
 	struct cg *cg = xcalloc(1, sizeof(struct cg));
@@ -38,28 +47,23 @@ struct cg *gp8_decode(uint8_t *data, size_t size)
 	cg->palette = xmalloc(256 * 4);
 	memcpy(cg->palette, data + 8, 256 * 4);
 
+	// rows are stored bottom-up; one byte of slack so that oversized data is
+	// detected (extra rows are ignored)
 	size_t pos = 8 + 256 * 4;
-	size_t px_size;
-	uint8_t *px = lzss_decompress(data + pos, size - pos, &px_size);
-	if (px_size != stride * cg->metrics.h) {
+	const size_t expected = stride * cg->metrics.h;
+	cg->pixels = xmalloc(max(cg->metrics.w * cg->metrics.h, 1));
+	size_t px_size = lzss_decompress_rows(data + pos, size - pos, stride,
+			expected + 1, gp8_decode_row, cg);
+	if (px_size != expected) {
 		WARNING("Unexpected size for GP8 pixel data (expected %u; got %u)",
-				(unsigned)stride * cg->metrics.h,
-				(unsigned)px_size);
-		if (px_size < stride * cg->metrics.h) {
-			free(cg->palette);
+				(unsigned)expected, (unsigned)px_size);
+		if (px_size < expected) {
 			free(cg->pixels);
+			free(cg->palette);
 			free(cg);
 			return NULL;
 		}
 	}
 
-	cg->pixels = xmalloc(cg->metrics.w * cg->metrics.h);
-	for (int i = 0; i < cg->metrics.h; i++) {
-		uint8_t *dst = cg->pixels + cg->metrics.w * i;
-		uint8_t *src = px + stride * (cg->metrics.h - (i + 1));
-		memcpy(dst, src, cg->metrics.w);
-	}
-	free(px);
-
 	return cg;
 }
@@ -69,11 +69,17 @@ static uint8_t *pixel_offset(struct cg *cg, int col, int row)
 	return cg->pixels + row * cg->metrics.w * 4 + col * 4;
 }
 
+// 5-bit to 8-bit channel, scaled so that 31 maps to 255
+static const uint8_t c5_to_c8[32] = {
+	  0,   8,  16,  24,  32,  41,  49,  57,  65,  74,  82,  90,  98, 106, 115, 123,
+	131, 139, 148, 156, 164, 172, 180, 189, 197, 205, 213, 222, 230, 238, 246, 255,
+};
+
 static void write_bgr555(uint8_t *dst, uint16_t px)
 {
-	dst[0] = (((px >> 10) & 0x1f) / 31.f) * 255;
-	dst[1] = (((px >> 5) & 0x1f) / 31.f) * 255;
-	dst[2] = ((px & 0x1f) / 31.f) * 255;
+	dst[0] = c5_to_c8[(px >> 10) & 0x1f];
+	dst[1] = c5_to_c8[(px >> 5) & 0x1f];
+	dst[2] = c5_to_c8[px & 0x1f];
 	dst[3] = 255;
 }
 
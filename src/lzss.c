@@ -15,61 +15,238 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 
 #include "nulib.h"
-#include "nulib/buffer.h"
 #include "ai5/lzss.h"
 
 #define FRAME_SIZE 0x1000
 #define FRAME_MASK (FRAME_SIZE - 1)
 
-uint8_t *lzss_decompress_with_limit(uint8_t *input, size_t input_size, size_t *output_size)
+/*
+ * Byte-aligned LZSS decoder.
+ *
+ * Rather than maintaining a separate 4 KB ring frame, back-references are
+ * resolved against the output buffer itself: the byte at ring position `off`
+ * is the output byte `dist` bytes back, where `dist` is the distance from
+ * `off` to the current ring position. Positions before the start of the
+ * output read as zero (the initial contents of the ring).
+ */
+
+// worst case output for one control byte, plus slack for 8-byte copies
+#define FAST_OUT_MARGIN (8 * 18 + 8)
+// worst case input for one control byte
+#define FAST_IN_MARGIN (1 + 8 * 2)
+
+struct lzss_state {
+	size_t in_pos;
+	size_t out_pos;
+	// position of `out` in the whole output (see lzss_decompress_rows)
+	size_t base;
+	unsigned ctl;
+	// pending back-reference (slow path only)
+	unsigned copy_dist;
+	unsigned copy_len;
+};
+
+static inline unsigned ring_dist(size_t out_pos, unsigned off, unsigned ring_start)
 {
-	uint8_t frame[FRAME_SIZE] = {0};
-	unsigned frame_pos = 0xfee;
+	unsigned dist = (ring_start + out_pos - off) & FRAME_MASK;
+	return dist ? dist : FRAME_SIZE;
+}
 
-	struct buffer in;
-	buffer_init(&in, input, input_size);
+/*
+ * Checked copy: handles sources before the start of the output.
+ */
+static void copy_match_slow(uint8_t *out, size_t pos, unsigned dist, unsigned len)
+{
+	for (unsigned i = 0; i < len; i++, pos++) {
+		out[pos] = pos >= dist ? out[pos - dist] : 0;
+	}
+}
 
-	struct buffer out;
-	size_t limit = *output_size;
-	if (!limit) {
-		buffer_init(&out, NULL, 0);
-		limit = 0xffffffff;
+/*
+ * Unchecked copy: the source lies entirely within the output and there is
+ * room to write up to 24 bytes.
+ */
+static inline void copy_match_fast(uint8_t *dst, unsigned dist, unsigned len)
+{
+	const uint8_t *src = dst - dist;
+	if (dist >= 16) {
+		memcpy(dst, src, 16);
+		if (len > 16)
+			memcpy(dst + 16, src + 16, 8);
+	} else if (dist >= 8) {
+		memcpy(dst, src, 8);
+		memcpy(dst + 8, src + 8, 8);
+		if (len > 16)
+			memcpy(dst + 16, src + 16, 8);
+	} else if (dist == 1) {
+		memset(dst, src[0], len);
 	} else {
-		buffer_init(&out, xmalloc(limit), limit);
+		for (unsigned i = 0; i < len; i++) {
+			dst[i] = src[i];
+		}
 	}
+}
 
-	while (!buffer_end(&in)) {
-		if (unlikely(out.index >= limit))
-			break;
-		buffer_reserve(&out, 18 * 8);
-		uint8_t ctl = buffer_read_u8_uc(&in);
-		for (unsigned bit = 1; bit != 0x100; bit <<= 1) {
-			if (ctl & bit) {
-				if (unlikely(buffer_remaining(&in) < 1))
-					break;
-				uint8_t b = buffer_read_u8_uc(&in);;
-				frame[frame_pos++ & FRAME_MASK] = b;
-				buffer_write_u8_uc(&out, b);
-			} else {
-				if (unlikely(buffer_remaining(&in) < 2))
-					break;
-				uint8_t lo = buffer_read_u8_uc(&in);
-				uint8_t hi = buffer_read_u8_uc(&in);
-				uint16_t offset = ((hi & 0xf0) << 4) | lo;
-				for (int count = 3 + (hi & 0xf); count != 0; --count) {
-					if (unlikely(out.index >= limit))
-						break;
-					uint8_t v = frame[offset++ & FRAME_MASK];
-					frame[frame_pos++ & FRAME_MASK] = v;
-					buffer_write_u8_uc(&out, v);
+/*
+ * Decode until the input is exhausted or `out_cap` bytes have been written.
+ * The state is left such that decoding can be resumed with a larger output
+ * buffer.
+ */
+static void lzss_decode(struct lzss_state *s, const uint8_t *in, size_t in_size,
+		uint8_t *out, size_t out_cap)
+{
+	size_t in_pos = s->in_pos;
+	size_t out_pos = s->out_pos;
+	const size_t base = s->base;
+	unsigned ctl = s->ctl;
+
+	// finish pending back-reference
+	if (s->copy_len) {
+		unsigned n = min(s->copy_len, out_cap - out_pos);
+		copy_match_slow(out, out_pos, s->copy_dist, n);
+		out_pos += n;
+		s->copy_len -= n;
+		if (s->copy_len)
+			goto end;
+	}
+
+	while (true) {
+		// fast path: a whole control byte's worth of tokens fits
+		while (ctl == 1 && in_size - in_pos >= FAST_IN_MARGIN
+				&& out_cap - out_pos >= FAST_OUT_MARGIN) {
+			uint8_t c = in[in_pos++];
+			if (c == 0xff) {
+				memcpy(out + out_pos, in + in_pos, 8);
+				in_pos += 8;
+				out_pos += 8;
+				continue;
+			}
+			for (unsigned bit = 1; bit != 0x100; bit <<= 1) {
+				if (c & bit) {
+					out[out_pos++] = in[in_pos++];
+					continue;
 				}
+				unsigned lo = in[in_pos++];
+				unsigned hi = in[in_pos++];
+				unsigned dist = ring_dist(base + out_pos, ((hi & 0xf0) << 4) | lo, 0xfee);
+				unsigned len = 3 + (hi & 0xf);
+				if (likely(out_pos >= dist))
+					copy_match_fast(out + out_pos, dist, len);
+				else
+					copy_match_slow(out, out_pos, dist, len);
+				out_pos += len;
 			}
 		}
+
+		// slow path: one token at a time near the ends of the buffers
+		if (out_pos >= out_cap)
+			break;
+		if (ctl == 1) {
+			if (in_pos >= in_size)
+				break;
+			ctl = in[in_pos++] | 0x100;
+		}
+		if (ctl & 1) {
+			if (in_pos >= in_size)
+				break;
+			out[out_pos++] = in[in_pos++];
+		} else {
+			if (in_size - in_pos < 2)
+				break;
+			unsigned lo = in[in_pos++];
+			unsigned hi = in[in_pos++];
+			unsigned dist = ring_dist(base + out_pos, ((hi & 0xf0) << 4) | lo, 0xfee);
+			unsigned len = 3 + (hi & 0xf);
+			unsigned n = min(len, out_cap - out_pos);
+			copy_match_slow(out, out_pos, dist, n);
+			out_pos += n;
+			if (n < len) {
+				s->copy_dist = dist;
+				s->copy_len = len - n;
+			}
+		}
+		ctl >>= 1;
+	}
+end:
+	s->in_pos = in_pos;
+	s->out_pos = out_pos;
+	s->ctl = ctl;
+}
+
+uint8_t *lzss_decompress_with_limit(uint8_t *input, size_t input_size, size_t *output_size)
+{
+	size_t limit = *output_size;
+	if (limit) {
+		uint8_t *out = xmalloc(limit);
+		*output_size = lzss_decompress_into(input, input_size, out, limit);
+		return out;
+	}
+
+	// output size unknown: grow the buffer until the input is consumed
+	struct lzss_state s = { .ctl = 1 };
+	size_t cap = max(input_size * 4, 4096);
+	uint8_t *out = xmalloc(cap);
+	while (true) {
+		lzss_decode(&s, input, input_size, out, cap);
+		if (s.out_pos < cap)
+			break;
+		cap *= 2;
+		out = xrealloc(out, cap);
+	}
+	*output_size = s.out_pos;
+	return out;
+}
+
+size_t lzss_decompress_into(const uint8_t *in, size_t in_size, uint8_t *out, size_t out_cap)
+{
+	struct lzss_state s = { .ctl = 1 };
+	lzss_decode(&s, in, in_size, out, out_cap);
+	return s.out_pos;
+}
+
+/*
+ * The output is decoded into a window which holds the (partial) current row
+ * and at least the last 4 KB of output, for back-references. When the window
+ * is full, it is slid back and `base` is advanced.
+ */
+#define ROWS_CHUNK_SIZE (32 * 1024)
+
+size_t lzss_decompress_rows(const uint8_t *in, size_t in_size, size_t stride, size_t out_cap,
+		lzss_row_callback row_fn, void *user)
+{
+	const size_t window_size = FRAME_SIZE + stride + max(stride, ROWS_CHUNK_SIZE);
+	// (plus room to zero-pad the last row)
+	uint8_t *window = xmalloc(window_size + stride);
+	struct lzss_state s = { .ctl = 1 };
+	size_t row_start = 0;
+	unsigned row = 0;
+	while (true) {
+		size_t cap = min(window_size, out_cap - s.base);
+		lzss_decode(&s, in, in_size, window, cap);
+		for (; stride && s.out_pos - row_start >= stride; row_start += stride) {
+			row_fn(user, row++, window + row_start);
+		}
+		if (s.out_pos < cap || s.base + s.out_pos == out_cap)
+			break;
+
+		// slide the window
+		size_t keep = s.out_pos >= FRAME_SIZE ? min(row_start, s.out_pos - FRAME_SIZE) : 0;
+		memmove(window, window + keep, s.out_pos - keep);
+		s.out_pos -= keep;
+		s.base += keep;
+		row_start -= keep;
 	}
-	*output_size = out.index;
-	return out.buf;
+
+	// pass on the incomplete last row, zero-padded
+	if (stride && s.out_pos > row_start) {
+		memset(window + s.out_pos, 0, stride - (s.out_pos - row_start));
+		row_fn(user, row, window + row_start);
+	}
+	free(window);
+	return s.base + s.out_pos;
 }
 
 uint8_t *lzss_decompress(uint8_t *input, size_t input_size, size_t *output_size)
@@ -78,154 +255,608 @@ uint8_t *lzss_decompress(uint8_t *input, size_t input_size, size_t *output_size)
 	return lzss_decompress_with_limit(input, input_size, output_size);
 }
 
-uint8_t *lzss_compress(uint8_t *input, size_t input_size, size_t *output_size)
+/*
+ * Match finder (shared by both encoders).
+ *
+ * Candidates are found with hash chains over the last 4 KB of input, keyed
+ * on 3 bytes. (The 2-byte matches allowed by the bitwise format save only
+ * one bit over two literals, and hashing on 2 bytes makes the chains much
+ * longer, so they are not considered.) The input is preceded by a run of
+ * zero bytes standing in for the initial contents of the decoder's ring, so
+ * that leading runs of zeros can be encoded as back-references too.
+ */
+
+#define HASH_BITS 15
+#define HASH_SIZE (1 << HASH_BITS)
+#define MATCH_PREFIX 18
+
+struct lz_matcher {
+	uint8_t *buf;      // input, preceded by MATCH_PREFIX zero bytes
+	size_t size;       // size of `buf`
+	size_t next;       // next position to insert into the hash chains
+	unsigned min_len;
+	unsigned max_len;
+	unsigned max_chain;
+	unsigned ring_start;
+	bool skip_off_zero; // the encoded offset may not be 0
+	int32_t *head;
+	int32_t prev[FRAME_SIZE];
+};
+
+static void lz_matcher_init(struct lz_matcher *m, const uint8_t *input, size_t input_size)
 {
-	struct buffer in;
-	buffer_init(&in, input, input_size);
+	m->size = MATCH_PREFIX + input_size;
+	m->buf = xcalloc(1, m->size + 1);
+	memcpy(m->buf + MATCH_PREFIX, input, input_size);
+	m->head = xmalloc(HASH_SIZE * sizeof(int32_t));
+	memset(m->head, 0xff, HASH_SIZE * sizeof(int32_t));
+	m->next = 0;
+}
 
-	struct buffer out;
-	buffer_init(&out, NULL, 0);
+static void lz_matcher_fini(struct lz_matcher *m)
+{
+	free(m->buf);
+	free(m->head);
+}
 
-	// TODO: write a proper implementation that actually compresses the data
-	//       (this implementation inflates the size by 12.5%).
-	while (!buffer_end(&in)) {
-		// write control byte
-		int rem = buffer_remaining(&in);
-		if (rem < 8)
-			buffer_write_u8(&out, (1 << rem) - 1);
-		else
-			buffer_write_u8(&out, 0xff);
+static inline unsigned lz_hash(struct lz_matcher *m, size_t i)
+{
+	const uint8_t *p = m->buf + i;
+	uint32_t v = (p[0] << 16) | (p[1] << 8) | p[2];
+	return (v * 2654435761u) >> (32 - HASH_BITS);
+}
 
-		// write data
-		int count = min(rem, 8);
-		for (int i = 0; i < count; i++) {
-			buffer_write_u8(&out, buffer_read_u8(&in));
-		}
+/*
+ * Find the longest match for the input at `i` (an index into `buf`).
+ * Returns the length of the match, or 0 if there is none of at least
+ * `min_len` bytes.
+ */
+static unsigned lz_find(struct lz_matcher *m, size_t i, unsigned *dist_out)
+{
+	// insert all preceding positions
+	for (; m->next < i; m->next++) {
+		if (m->next + 3 > m->size)
+			break;
+		unsigned h = lz_hash(m, m->next);
+		m->prev[m->next & FRAME_MASK] = m->head[h];
+		m->head[h] = m->next;
 	}
 
-	*output_size = out.index;
-	return out.buf;
+	const unsigned max_len = min(m->max_len, m->size - i);
+	if (max_len < 3)
+		return 0;
+
+	const uint8_t *cur = m->buf + i;
+	unsigned best_len = 0;
+	unsigned best_dist = 0;
+	unsigned chain = m->max_chain;
+	for (int32_t j = m->head[lz_hash(m, i)]; j >= 0 && chain; j = m->prev[j & FRAME_MASK], chain--) {
+		unsigned dist = i - j;
+		if (dist > FRAME_SIZE)
+			break;
+		const uint8_t *cand = m->buf + j;
+		if (cand[best_len] != cur[best_len] || cand[0] != cur[0])
+			continue;
+		unsigned len = 1;
+		while (len < max_len && cand[len] == cur[len])
+			len++;
+		if (len <= best_len)
+			continue;
+		if (m->skip_off_zero && ((m->ring_start + j - MATCH_PREFIX) & FRAME_MASK) == 0)
+			continue;
+		best_len = len;
+		best_dist = dist;
+		if (len == max_len)
+			break;
+	}
+	if (best_len < m->min_len)
+		return 0;
+	*dist_out = best_dist;
+	return best_len;
 }
 
 /*
- * "Bitwise" LZSS (data is not byte-aligned).
+ * Parse the input into literals and matches. Each position `i` is either a
+ * literal (len[i] = 0) or the start of a match, and the next token starts
+ * at `i + max(len[i], 1)`. Positions are relative to the start of the input.
  */
-uint8_t *lzss_bw_decompress(uint8_t *input, size_t input_size, size_t *output_size)
+struct lz_parse {
+	uint8_t *len;
+	uint16_t *dist;
+};
+
+static void lz_parse_greedy(struct lz_matcher *m, struct lz_parse *p, bool lazy)
 {
-	uint8_t frame[FRAME_SIZE] = {0};
-	unsigned frame_pos = 1;
+	const size_t n = m->size - MATCH_PREFIX;
+	unsigned len = 0, dist = 0;
+	bool have_next = false;
+	for (size_t i = 0; i < n;) {
+		if (!have_next)
+			len = lz_find(m, MATCH_PREFIX + i, &dist);
+		have_next = false;
+		if (lazy && len && len < m->max_len && i + 1 < n) {
+			// defer if the match at the next position is longer
+			unsigned next_dist;
+			unsigned next_len = lz_find(m, MATCH_PREFIX + i + 1, &next_dist);
+			if (next_len > len) {
+				p->len[i++] = 0;
+				len = next_len;
+				dist = next_dist;
+				have_next = true;
+				continue;
+			}
+		}
+		p->len[i] = len;
+		p->dist[i] = dist;
+		i += max(len, 1);
+	}
+}
 
-	struct bitbuffer b;
-	bitbuffer_init(&b, input, input_size);
+/*
+ * Minimize the encoded size in bits, given the longest match at each
+ * position (any shorter match at the same distance is also available).
+ */
+static void lz_parse_optimal(struct lz_matcher *m, struct lz_parse *p,
+		unsigned lit_bits, unsigned match_bits)
+{
+	const size_t n = m->size - MATCH_PREFIX;
+	for (size_t i = 0; i < n; i++) {
+		unsigned dist = 0;
+		p->len[i] = lz_find(m, MATCH_PREFIX + i, &dist);
+		p->dist[i] = dist;
+	}
 
-	struct buffer out;
-	buffer_init(&out, NULL, 0);
+	uint32_t *cost = xmalloc((n + 1) * sizeof(uint32_t));
+	cost[n] = 0;
+	for (size_t i = n; i-- > 0;) {
+		uint32_t best = cost[i + 1] + lit_bits;
+		unsigned best_len = 0;
+		for (unsigned len = m->min_len; len <= p->len[i]; len++) {
+			uint32_t c = cost[i + len] + match_bits;
+			if (c < best) {
+				best = c;
+				best_len = len;
+			}
+		}
+		cost[i] = best;
+		p->len[i] = best_len;
+	}
+	free(cost);
+}
 
-	while (true) {
-		if (bitbuffer_read_bit(&b)) {
-			uint8_t c = bitbuffer_read_number(&b, 8);
-			frame[frame_pos++ & FRAME_MASK] = c;
-			buffer_write_u8(&out, c);
+static void lz_parse(struct lz_matcher *m, struct lz_parse *p, enum lzss_level level,
+		unsigned lit_bits, unsigned match_bits)
+{
+	const size_t n = m->size - MATCH_PREFIX;
+	p->len = xmalloc(max(n, 1));
+	p->dist = xmalloc(max(n, 1) * sizeof(uint16_t));
+	switch (level) {
+	case LZSS_FAST:
+		m->max_chain = 16;
+		lz_parse_greedy(m, p, false);
+		break;
+	case LZSS_DEFAULT:
+		m->max_chain = 128;
+		lz_parse_greedy(m, p, true);
+		break;
+	case LZSS_BEST:
+	default:
+		m->max_chain = 1024;
+		lz_parse_optimal(m, p, lit_bits, match_bits);
+		break;
+	}
+}
+
+static void lz_parse_free(struct lz_parse *p)
+{
+	free(p->len);
+	free(p->dist);
+}
+
+uint8_t *lzss_compress_level(uint8_t *input, size_t input_size, enum lzss_level level,
+		size_t *output_size)
+{
+	struct lz_matcher m;
+	lz_matcher_init(&m, input, input_size);
+	m.min_len = 3;
+	m.max_len = 18;
+	m.ring_start = 0xfee;
+	m.skip_off_zero = false;
+
+	struct lz_parse p;
+	lz_parse(&m, &p, level, 9, 17);
+
+	// worst case: all literals
+	uint8_t *out = xmalloc(input_size + (input_size + 7) / 8 + 1);
+	size_t out_pos = 0;
+	size_t ctl_pos = 0;
+	unsigned bit = 0x100;
+	for (size_t i = 0; i < input_size;) {
+		if (bit == 0x100) {
+			ctl_pos = out_pos++;
+			out[ctl_pos] = 0;
+			bit = 1;
+		}
+		unsigned len = p.len[i];
+		if (!len) {
+			out[ctl_pos] |= bit;
+			out[out_pos++] = input[i++];
 		} else {
-			unsigned off = bitbuffer_read_number(&b, 12);
-			if (!off)
-				break;
-			unsigned len = bitbuffer_read_number(&b, 4) + 2;
-			for (int i = 0; i < len; i++) {
-				uint8_t c = frame[off++ & FRAME_MASK];
-				frame[frame_pos++ & FRAME_MASK] = c;
-				buffer_write_u8(&out, c);
-			}
+			unsigned off = (0xfee + i - p.dist[i]) & FRAME_MASK;
+			out[out_pos++] = off & 0xff;
+			out[out_pos++] = ((off >> 4) & 0xf0) | (len - 3);
+			i += len;
 		}
+		bit <<= 1;
 	}
-	*output_size = out.index;
-	return out.buf;
+
+	lz_parse_free(&p);
+	lz_matcher_fini(&m);
+	*output_size = out_pos;
+	return xrealloc(out, max(out_pos, 1));
 }
 
-struct bitwriter {
-	uint8_t *buf;
-	size_t buf_size;
-	int index;
-	int current;
-	int bit;
+uint8_t *lzss_compress(uint8_t *input, size_t input_size, size_t *output_size)
+{
+	return lzss_compress_level(input, input_size, LZSS_DEFAULT, output_size);
+}
+
+/*
+ * "Bitwise" LZSS (data is not byte-aligned).
+ *
+ * Fields are read MSB-first from a 64-bit reservoir which is refilled
+ * before each token, so that a whole token (at most 17 bits) can be pulled
+ * out with shifts and masks. Past the end of the input, zeros are read
+ * (which decodes as the terminator). Back-references are resolved against
+ * the output buffer, as for the byte-aligned format; the ring starts at 1.
+ */
+
+struct lzss_bw_state {
+	size_t in_pos;
+	size_t out_pos;
+	uint64_t bits;
+	unsigned nr_bits;
+	bool done;
+	// pending back-reference
+	unsigned copy_dist;
+	unsigned copy_len;
 };
 
-static void bitwriter_init(struct bitwriter *buf)
+static inline uint64_t load_be64(const uint8_t *b)
+{
+	return ((uint64_t)b[0] << 56) | ((uint64_t)b[1] << 48)
+		| ((uint64_t)b[2] << 40) | ((uint64_t)b[3] << 32)
+		| ((uint64_t)b[4] << 24) | ((uint64_t)b[5] << 16)
+		| ((uint64_t)b[6] << 8) | (uint64_t)b[7];
+}
+
+/*
+ * Make sure at least 56 bits are in the reservoir.
+ */
+static inline void bw_refill(struct lzss_bw_state *s, const uint8_t *in, size_t in_size)
 {
-	buf->buf = xmalloc(64);
-	buf->buf_size = 64;
-	buf->index = 0;
-	buf->current = 0;
-	buf->bit = 0;
+	if (likely(in_size - s->in_pos >= 8)) {
+		// bytes which are only partially consumed are reloaded next time
+		s->bits |= load_be64(in + s->in_pos) >> s->nr_bits;
+		s->in_pos += (63 - s->nr_bits) >> 3;
+		s->nr_bits |= 56;
+		return;
+	}
+	while (s->nr_bits <= 56 && s->in_pos < in_size) {
+		s->bits |= (uint64_t)in[s->in_pos++] << (56 - s->nr_bits);
+		s->nr_bits += 8;
+	}
+	if (s->in_pos >= in_size)
+		s->nr_bits = 64;
 }
 
-static void bitwriter_prewrite(struct bitwriter *b)
+static void lzss_bw_decode(struct lzss_bw_state *s, const uint8_t *in, size_t in_size,
+		uint8_t *out, size_t out_cap)
 {
-	if (b->bit == 8) {
-		if (b->index + 1 >= b->buf_size) {
-			b->buf_size *= 2;
-			b->buf = xrealloc(b->buf, b->buf_size);
+	size_t out_pos = s->out_pos;
+
+	// finish pending back-reference
+	if (s->copy_len) {
+		unsigned n = min(s->copy_len, out_cap - out_pos);
+		copy_match_slow(out, out_pos, s->copy_dist, n);
+		out_pos += n;
+		s->copy_len -= n;
+	}
+
+	while (!s->done && out_pos < out_cap) {
+		bw_refill(s, in, in_size);
+		if (s->bits >> 63) {
+			out[out_pos++] = s->bits >> 55;
+			s->bits <<= 9;
+			s->nr_bits -= 9;
+			continue;
+		}
+		unsigned off = (s->bits >> 51) & 0xfff;
+		if (!off) {
+			s->done = true;
+			break;
+		}
+		unsigned len = ((s->bits >> 47) & 0xf) + 2;
+		s->bits <<= 17;
+		s->nr_bits -= 17;
+
+		unsigned dist = ring_dist(out_pos, off, 1);
+		if (likely(out_pos >= dist && out_cap - out_pos >= 24)) {
+			copy_match_fast(out + out_pos, dist, len);
+			out_pos += len;
+			continue;
+		}
+		unsigned n = min(len, out_cap - out_pos);
+		copy_match_slow(out, out_pos, dist, n);
+		out_pos += n;
+		if (n < len) {
+			s->copy_dist = dist;
+			s->copy_len = len - n;
 		}
-		b->buf[b->index++] = b->current;
-		b->current = 0;
-		b->bit = 0;
 	}
+	s->out_pos = out_pos;
+}
+
+uint8_t *lzss_bw_decompress(uint8_t *input, size_t input_size, size_t *output_size)
+{
+	struct lzss_bw_state s = {0};
+	size_t cap = max(input_size * 4, 4096);
+	uint8_t *out = xmalloc(cap);
+	while (true) {
+		lzss_bw_decode(&s, input, input_size, out, cap);
+		if (s.out_pos < cap)
+			break;
+		cap *= 2;
+		out = xrealloc(out, cap);
+	}
+	*output_size = s.out_pos;
+	return out;
+}
+
+size_t lzss_bw_decompress_into(const uint8_t *in, size_t in_size, uint8_t *out, size_t out_cap)
+{
+	struct lzss_bw_state s = {0};
+	lzss_bw_decode(&s, in, in_size, out, out_cap);
+	return s.out_pos;
+}
+
+/*
+ * Incremental decoder.
+ */
+
+void lzss_decoder_init(struct lzss_decoder *d, bool bitwise)
+{
+	memset(d, 0, sizeof(struct lzss_decoder));
+	d->bitwise = bitwise;
+	d->frame_pos = bitwise ? 1 : 0xfee;
+	d->ctl = 1;
+}
+
+void lzss_decoder_input(struct lzss_decoder *d, const uint8_t *in, size_t size, bool final)
+{
+	d->in = in;
+	d->in_size = size;
+	d->in_pos = 0;
+	d->in_final = final;
+}
+
+/*
+ * Returns false (without consuming anything) if the input runs out before
+ * the token is complete.
+ */
+static bool decoder_token(struct lzss_decoder *d, uint8_t *out, size_t *pos)
+{
+	const size_t rem = d->in_size - d->in_pos;
+	if (d->ctl == 1) {
+		if (rem < 1)
+			goto need_input;
+		d->ctl = d->in[d->in_pos++] | 0x100;
+		return true;
+	}
+	if (d->ctl & 1) {
+		if (rem < 1)
+			goto need_input;
+		uint8_t c = d->in[d->in_pos++];
+		d->frame[d->frame_pos++ & FRAME_MASK] = c;
+		out[(*pos)++] = c;
+	} else {
+		if (rem < 2)
+			goto need_input;
+		uint8_t lo = d->in[d->in_pos++];
+		uint8_t hi = d->in[d->in_pos++];
+		d->copy_off = ((hi & 0xf0) << 4) | lo;
+		d->copy_len = 3 + (hi & 0xf);
+	}
+	d->ctl >>= 1;
+	return true;
+need_input:
+	if (d->in_final)
+		d->done = true;
+	return false;
 }
 
-static void bitwriter_end(struct bitwriter *b)
+/*
+ * Make sure at least `n` bits are in the reservoir. Past the end of the
+ * input, zeros are read.
+ */
+static bool decoder_bw_fill(struct lzss_decoder *d, unsigned n)
 {
-	while (b->bit < 8) {
-		b->current <<= 1;
-		b->bit++;
+	while (d->nr_bits < n) {
+		if (d->in_pos < d->in_size) {
+			d->bits |= (uint32_t)d->in[d->in_pos++] << (24 - d->nr_bits);
+			d->nr_bits += 8;
+		} else if (d->in_final) {
+			d->nr_bits = n;
+		} else {
+			return false;
+		}
 	}
-	bitwriter_prewrite(b);
+	return true;
 }
 
-static void bitwriter_write_1(struct bitwriter *b)
+static void decoder_bw_consume(struct lzss_decoder *d, unsigned n)
 {
-	bitwriter_prewrite(b);
-	b->current = (b->current << 1) + 1;
-	b->bit++;
+	d->bits <<= n;
+	d->nr_bits -= n;
 }
 
-static void bitwriter_write_0(struct bitwriter *b)
+static bool decoder_bw_token(struct lzss_decoder *d, uint8_t *out, size_t *pos)
 {
-	bitwriter_prewrite(b);
-	b->current <<= 1;
-	b->bit++;
+	if (!decoder_bw_fill(d, 1))
+		return false;
+	if (d->bits & 0x80000000) {
+		if (!decoder_bw_fill(d, 9))
+			return false;
+		uint8_t c = d->bits >> 23;
+		decoder_bw_consume(d, 9);
+		d->frame[d->frame_pos++ & FRAME_MASK] = c;
+		out[(*pos)++] = c;
+		return true;
+	}
+	if (!decoder_bw_fill(d, 13))
+		return false;
+	unsigned off = (d->bits >> 19) & 0xfff;
+	if (!off) {
+		decoder_bw_consume(d, 13);
+		d->done = true;
+		return false;
+	}
+	if (!decoder_bw_fill(d, 17))
+		return false;
+	d->copy_off = off;
+	d->copy_len = ((d->bits >> 15) & 0xf) + 2;
+	decoder_bw_consume(d, 17);
+	return true;
 }
 
-static void bitwriter_write_u8(struct bitwriter *w, uint8_t b)
+size_t lzss_decoder_read(struct lzss_decoder *d, uint8_t *out, size_t size)
 {
-	for (int i = 0; i < 8; i++) {
-		if (b & 0x80)
-			bitwriter_write_1(w);
-		else
-			bitwriter_write_0(w);
-		b <<= 1;
+	size_t pos = 0;
+	while (pos < size) {
+		// finish pending back-reference
+		if (d->copy_len) {
+			unsigned n = min(d->copy_len, size - pos);
+			for (unsigned i = 0; i < n; i++) {
+				uint8_t c = d->frame[d->copy_off++ & FRAME_MASK];
+				d->frame[d->frame_pos++ & FRAME_MASK] = c;
+				out[pos++] = c;
+			}
+			d->copy_len -= n;
+			continue;
+		}
+		if (d->done)
+			break;
+		if (d->bitwise) {
+			if (!decoder_bw_token(d, out, &pos))
+				break;
+		} else {
+			if (!decoder_token(d, out, &pos))
+				break;
+		}
 	}
+	return pos;
 }
 
-uint8_t *lzss_bw_compress(uint8_t *input, size_t input_size, size_t *output_size)
+void lzss_decoder_save(const struct lzss_decoder *d, struct lzss_checkpoint *cp)
 {
-	struct buffer in;
-	buffer_init(&in, input, input_size);
+	memcpy(cp->frame, d->frame, FRAME_SIZE);
+	cp->frame_pos = d->frame_pos;
+	cp->copy_off = d->copy_off;
+	cp->copy_len = d->copy_len;
+	cp->ctl = d->ctl;
+	cp->bits = d->bits;
+	cp->nr_bits = d->nr_bits;
+	cp->done = d->done;
+}
 
-	struct bitwriter out;
-	bitwriter_init(&out);
+void lzss_decoder_restore(struct lzss_decoder *d, const struct lzss_checkpoint *cp)
+{
+	memcpy(d->frame, cp->frame, FRAME_SIZE);
+	d->frame_pos = cp->frame_pos;
+	d->copy_off = cp->copy_off;
+	d->copy_len = cp->copy_len;
+	d->ctl = cp->ctl;
+	d->bits = cp->bits;
+	d->nr_bits = cp->nr_bits;
+	d->done = cp->done;
+	d->in = NULL;
+	d->in_size = 0;
+	d->in_pos = 0;
+	d->in_final = false;
+}
+
+/*
+ * Bit writer for the bitwise format: fields are shifted into a 64-bit
+ * accumulator (MSB-first) and flushed 32 bits at a time.
+ */
+struct bitwriter {
+	uint8_t *buf;
+	size_t index;
+	uint64_t acc;
+	unsigned nr_bits;
+};
+
+static inline void bitwriter_put(struct bitwriter *w, uint32_t v, unsigned n)
+{
+	w->acc = (w->acc << n) | v;
+	w->nr_bits += n;
+	if (w->nr_bits >= 32) {
+		w->nr_bits -= 32;
+		uint32_t out = w->acc >> w->nr_bits;
+		w->buf[w->index++] = out >> 24;
+		w->buf[w->index++] = out >> 16;
+		w->buf[w->index++] = out >> 8;
+		w->buf[w->index++] = out;
+	}
+}
 
-	// write data
-	while (!buffer_end(&in)) {
-		bitwriter_write_1(&out);
-		bitwriter_write_u8(&out, buffer_read_u8(&in));
+static void bitwriter_end(struct bitwriter *w)
+{
+	// pad to a byte boundary with zeros
+	bitwriter_put(w, 0, (8 - (w->nr_bits & 7)) & 7);
+	while (w->nr_bits) {
+		w->nr_bits -= 8;
+		w->buf[w->index++] = w->acc >> w->nr_bits;
 	}
+}
+
+uint8_t *lzss_bw_compress_level(uint8_t *input, size_t input_size, enum lzss_level level,
+		size_t *output_size)
+{
+	struct lz_matcher m;
+	lz_matcher_init(&m, input, input_size);
+	m.min_len = 2;
+	m.max_len = 17;
+	m.ring_start = 1;
+	// an offset of 0 is the terminator
+	m.skip_off_zero = true;
+
+	struct lz_parse p;
+	lz_parse(&m, &p, level, 9, 17);
 
-	// write terminator
-	for (int i = 0; i < 13; i++) {
-		bitwriter_write_0(&out);
+	// worst case: all literals, plus the terminator and a flush
+	struct bitwriter w = {0};
+	w.buf = xmalloc((input_size * 9 + 13) / 8 + 8);
+	for (size_t i = 0; i < input_size;) {
+		unsigned len = p.len[i];
+		if (!len) {
+			bitwriter_put(&w, 0x100 | input[i++], 9);
+		} else {
+			unsigned off = (1 + i - p.dist[i]) & FRAME_MASK;
+			bitwriter_put(&w, (off << 4) | (len - 2), 17);
+			i += len;
+		}
 	}
+	bitwriter_put(&w, 0, 13);
+	bitwriter_end(&w);
+
+	lz_parse_free(&p);
+	lz_matcher_fini(&m);
+	*output_size = w.index;
+	return xrealloc(w.buf, w.index);
+}
 
-	bitwriter_end(&out);
-	*output_size = out.index;
-	return out.buf;
+uint8_t *lzss_bw_compress(uint8_t *input, size_t input_size, size_t *output_size)
+{
+	return lzss_bw_compress_level(input, input_size, LZSS_DEFAULT, output_size);
 }
@@ -0,0 +1,99 @@
+/* Copyright (C) 2023 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+/*
+ * Check that every set of pixel format conversion kernels produces exactly
+ * the same output as the scalar kernels.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ai5/cg.h"
+
+#define MAX_WIDTH 300
+
+static const struct {
+	const char *name;
+	void (*fn)(uint8_t *dst, const uint8_t *src, unsigned w);
+	unsigned src_bpp;
+	unsigned dst_bpp;
+} kernels[] = {
+	{ "bgr555_to_rgba", cg_bgr555_to_rgba, 2, 4 },
+	{ "bgr_to_rgba",    cg_bgr_to_rgba,    3, 4 },
+	{ "bgra_to_rgba",   cg_bgra_to_rgba,   4, 4 },
+	{ "rgba_to_bgr555", cg_rgba_to_bgr555, 4, 2 },
+	{ "rgba_to_bgr",    cg_rgba_to_bgr,    4, 3 },
+	{ "rgba_to_bgra",   cg_rgba_to_bgra,   4, 4 },
+};
+
+static const char *isa_names[] = {
+	[CG_CONVERT_SCALAR] = "scalar",
+	[CG_CONVERT_SSE2] = "sse2",
+	[CG_CONVERT_SSSE3] = "ssse3",
+	[CG_CONVERT_AVX2] = "avx2",
+};
+
+static uint32_t rand_state = 1;
+
+static uint8_t rand_byte(void)
+{
+	rand_state = rand_state * 1103515245 + 12345;
+	return rand_state >> 16;
+}
+
+int main(void)
+{
+	unsigned nr_failed = 0;
+	for (unsigned k = 0; k < sizeof(kernels) / sizeof(*kernels); k++) {
+		for (unsigned w = 0; w <= MAX_WIDTH; w++) {
+			// buffers are allocated at their exact size, so that a
+			// memory checker can catch accesses outside of the row
+			const size_t src_size = w * kernels[k].src_bpp;
+			const size_t dst_size = w * kernels[k].dst_bpp;
+			uint8_t *src = malloc(src_size + 1);
+			uint8_t *ref = malloc(dst_size + 1);
+			uint8_t *out = malloc(dst_size + 1);
+			for (size_t i = 0; i < src_size; i++) {
+				src[i] = rand_byte();
+			}
+
+			cg_convert_select(CG_CONVERT_SCALAR);
+			kernels[k].fn(ref, src, w);
+			for (int isa = CG_CONVERT_SSE2; isa <= CG_CONVERT_AVX2; isa++) {
+				if (!cg_convert_select(isa))
+					continue;
+				memset(out, 0, dst_size);
+				kernels[k].fn(out, src, w);
+				if (memcmp(out, ref, dst_size)) {
+					printf("FAIL: %s (%s), width %u\n", kernels[k].name,
+							isa_names[isa], w);
+					nr_failed++;
+				}
+			}
+			free(src);
+			free(ref);
+			free(out);
+		}
+	}
+
+	for (int isa = CG_CONVERT_SCALAR; isa <= CG_CONVERT_AVX2; isa++) {
+		printf("%s: %s\n", isa_names[isa],
+				cg_convert_select(isa) ? "tested" : "not supported");
+	}
+	return nr_failed ? 1 : 0;
+}
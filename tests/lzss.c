@@ -0,0 +1,287 @@
+/* Copyright (C) 2023 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+/*
+ * LZSS round-trip test and benchmark.
+ *
+ * Without arguments, data is compressed at every level in both formats
+ * (byte and bitwise) and decompressed with every decoder; the output must
+ * match the input. Decoders are also fed garbage, which must not crash
+ * them.
+ *
+ * With --bench, the compression ratio and the throughput of each compressor
+ * and decoder are measured on a synthetic corpus.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ai5/lzss.h"
+
+#define CORPUS_SIZE (2 * 1024 * 1024)
+
+static uint32_t rand_state = 1;
+
+static uint32_t rand_next(void)
+{
+	rand_state = rand_state * 1103515245 + 12345;
+	return rand_state >> 8;
+}
+
+/*
+ * Random size in [lo, lo + spread), clamped to `limit`. (min() evaluates
+ * its arguments twice, so it can't be given rand_next() directly.)
+ */
+static size_t rand_size(size_t lo, size_t spread, size_t limit)
+{
+	size_t n = lo + rand_next() % spread;
+	return min(n, limit);
+}
+
+/*
+ * Mixed data resembling archive contents: text, 24-bit images with smooth
+ * gradients and flat areas, runs and random (incompressible) bytes.
+ */
+static uint8_t *make_corpus(size_t size)
+{
+	static const char *words[] = {
+		"the ", "of ", "and ", "message ", "scene ", "\\n", "\x82\xa0", "\x82\xa2",
+		"call ", "set ", "if ", "else ", "0x", "var", "[", "];\r\n",
+	};
+	uint8_t *data = malloc(size);
+	size_t pos = 0;
+	while (pos < size) {
+		size_t n = rand_size(4096, 65536, size - pos);
+		switch (rand_next() % 4) {
+		case 0:
+			for (size_t i = 0; i < n;) {
+				const char *w = words[rand_next() % 16];
+				for (; *w && i < n; w++, i++)
+					data[pos + i] = *w;
+			}
+			break;
+		case 1: {
+			unsigned r = rand_next(), g = rand_next(), b = rand_next();
+			for (size_t i = 0; i + 3 <= n; i += 3) {
+				if (rand_next() % 16 == 0) {
+					r += rand_next() % 3;
+					g += rand_next() % 3;
+					b -= rand_next() % 3;
+				}
+				data[pos + i] = b;
+				data[pos + i + 1] = g;
+				data[pos + i + 2] = r;
+			}
+			for (size_t i = n - n % 3; i < n; i++)
+				data[pos + i] = 0;
+			break;
+		}
+		case 2:
+			for (size_t i = 0; i < n;) {
+				size_t run = rand_size(1, 300, n - i);
+				memset(data + pos + i, rand_next(), run);
+				i += run;
+			}
+			break;
+		case 3:
+			for (size_t i = 0; i < n; i++)
+				data[pos + i] = rand_next();
+			break;
+		}
+		pos += n;
+	}
+	return data;
+}
+
+static const char *level_names[] = {
+	[LZSS_FAST] = "fast",
+	[LZSS_DEFAULT] = "default",
+	[LZSS_BEST] = "best",
+};
+
+static uint8_t *compress(bool bitwise, uint8_t *in, size_t size, enum lzss_level level,
+		size_t *out_size)
+{
+	if (bitwise)
+		return lzss_bw_compress_level(in, size, level, out_size);
+	return lzss_compress_level(in, size, level, out_size);
+}
+
+/*
+ * Decompress with the incremental decoder, feeding input and reading output
+ * in small pieces of varying size.
+ */
+static size_t decode_incremental(bool bitwise, const uint8_t *in, size_t in_size,
+		uint8_t *out, size_t out_cap)
+{
+	struct lzss_decoder d;
+	lzss_decoder_init(&d, bitwise);
+	size_t in_end = 0, out_pos = 0;
+	lzss_decoder_input(&d, in, 0, in_size == 0);
+	while (out_pos < out_cap) {
+		size_t n = rand_size(1, 700, out_cap - out_pos);
+		size_t got = lzss_decoder_read(&d, out + out_pos, n);
+		out_pos += got;
+		if (got == n)
+			continue;
+		if (d.done || d.in_final)
+			break;
+		// resupply the unconsumed tail of the previous chunk plus some more
+		size_t consumed = (d.in - in) + d.in_pos;
+		in_end = rand_size(in_end + 1, 300, in_size);
+		lzss_decoder_input(&d, in + consumed, in_end - consumed, in_end == in_size);
+	}
+	return out_pos;
+}
+
+static unsigned nr_failed = 0;
+
+static void check(bool ok, const char *what, bool bitwise, enum lzss_level level, size_t size)
+{
+	if (ok)
+		return;
+	printf("FAIL: %s (%s, %s), %zu bytes\n", what, bitwise ? "bitwise" : "byte",
+			level_names[level], size);
+	nr_failed++;
+}
+
+static void test_roundtrip(uint8_t *in, size_t size)
+{
+	uint8_t *out = malloc(size + 1);
+	for (int bitwise = 0; bitwise < 2; bitwise++) {
+		for (int level = LZSS_FAST; level <= LZSS_BEST; level++) {
+			size_t z_size;
+			uint8_t *z = compress(bitwise, in, size, level, &z_size);
+
+			size_t out_size;
+			uint8_t *dec = bitwise ? lzss_bw_decompress(z, z_size, &out_size)
+				: lzss_decompress(z, z_size, &out_size);
+			check(dec && out_size == size && !memcmp(dec, in, size),
+					"decompress", bitwise, level, size);
+			free(dec);
+
+			// one byte of slack: the decoder must stop at the end of the data
+			out_size = bitwise ? lzss_bw_decompress_into(z, z_size, out, size + 1)
+				: lzss_decompress_into(z, z_size, out, size + 1);
+			check(out_size == size && !memcmp(out, in, size),
+					"decompress_into", bitwise, level, size);
+
+			out_size = decode_incremental(bitwise, z, z_size, out, size + 1);
+			check(out_size == size && !memcmp(out, in, size),
+					"incremental decoder", bitwise, level, size);
+			free(z);
+		}
+	}
+	free(out);
+}
+
+static void test_garbage(void)
+{
+	uint8_t in[4096];
+	uint8_t out[8192];
+	for (int i = 0; i < 2000; i++) {
+		size_t in_size = rand_next() % sizeof(in);
+		for (size_t j = 0; j < in_size; j++)
+			in[j] = rand_next();
+		size_t cap = rand_next() % sizeof(out);
+		lzss_decompress_into(in, in_size, out, cap);
+		lzss_bw_decompress_into(in, in_size, out, cap);
+		decode_incremental(false, in, in_size, out, cap);
+		decode_incremental(true, in, in_size, out, cap);
+		if (i % 100 == 0) {
+			size_t out_size;
+			free(lzss_decompress(in, in_size, &out_size));
+			free(lzss_bw_decompress(in, in_size, &out_size));
+		}
+	}
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#define BENCH_RUNS 5
+
+static void bench(uint8_t *corpus, size_t size)
+{
+	printf("%zu byte corpus, best of %d runs, MB/s of uncompressed data\n",
+			size, BENCH_RUNS);
+	printf("%-8s %-8s %7s %10s %10s %10s\n", "format", "level", "ratio", "compress",
+			"decompress", "into");
+	uint8_t *out = malloc(size);
+	for (int bitwise = 0; bitwise < 2; bitwise++) {
+		for (int level = LZSS_FAST; level <= LZSS_BEST; level++) {
+			double t_comp = 1e9, t_dec = 1e9, t_into = 1e9;
+			size_t z_size = 0;
+			for (int run = 0; run < BENCH_RUNS; run++) {
+				double t = now();
+				uint8_t *z = compress(bitwise, corpus, size, level, &z_size);
+				t_comp = min(t_comp, now() - t);
+
+				size_t out_size;
+				t = now();
+				uint8_t *dec = bitwise ? lzss_bw_decompress(z, z_size, &out_size)
+					: lzss_decompress(z, z_size, &out_size);
+				t_dec = min(t_dec, now() - t);
+				free(dec);
+
+				t = now();
+				if (bitwise)
+					lzss_bw_decompress_into(z, z_size, out, size);
+				else
+					lzss_decompress_into(z, z_size, out, size);
+				t_into = min(t_into, now() - t);
+				free(z);
+			}
+			printf("%-8s %-8s %6.1f%% %10.1f %10.1f %10.1f\n",
+					bitwise ? "bitwise" : "byte", level_names[level],
+					100.0 * z_size / size, size / t_comp / 1e6,
+					size / t_dec / 1e6, size / t_into / 1e6);
+		}
+	}
+	free(out);
+}
+
+int main(int argc, char *argv[])
+{
+	uint8_t *corpus = make_corpus(CORPUS_SIZE);
+	if (argc > 1 && !strcmp(argv[1], "--bench")) {
+		bench(corpus, CORPUS_SIZE);
+		free(corpus);
+		return 0;
+	}
+
+	// small sizes (including empty input), then slices of the corpus
+	for (size_t size = 0; size < 64; size++) {
+		test_roundtrip(corpus + rand_next() % (CORPUS_SIZE - size), size);
+	}
+	for (int i = 0; i < 100; i++) {
+		size_t size = 64 + rand_next() % (64 * 1024);
+		test_roundtrip(corpus + rand_next() % (CORPUS_SIZE - size), size);
+	}
+	test_roundtrip(corpus, CORPUS_SIZE);
+	test_garbage();
+
+	free(corpus);
+	if (nr_failed)
+		printf("%u failures\n", nr_failed);
+	return nr_failed ? 1 : 0;
+}
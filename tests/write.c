@@ -0,0 +1,239 @@
+/* Copyright (C) 2023 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+/*
+ * Archive writer round-trip test: archives of every type and index scheme
+ * are written, reopened with archive_open (which detects the layout from
+ * scratch) and compared entry by entry with what was written.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ai5/arc.h"
+#include "ai5/game.h"
+
+// archive_open detects the archive type from the file extension
+static const char *tmp_paths[] = {
+	[ARCHIVE_TYPE_ARC] = "test_write.arc",
+	[ARCHIVE_TYPE_DAT] = "test_write.dat",
+	[ARCHIVE_TYPE_AWD] = "test_write.awd",
+	[ARCHIVE_TYPE_AWF] = "test_write.awf",
+};
+
+static unsigned nr_failed = 0;
+
+static void fail(const char *what, const char *msg)
+{
+	printf("FAIL: %s: %s\n", what, msg);
+	nr_failed++;
+}
+
+static size_t entry_size(unsigned i)
+{
+	return 100 + (i * 7919) % 5000;
+}
+
+static uint8_t *entry_data(unsigned i)
+{
+	const size_t size = entry_size(i);
+	uint8_t *data = malloc(size);
+	uint32_t s = i * 2654435761u;
+	for (size_t j = 0; j < size; j++) {
+		s = s * 1103515245 + 12345;
+		// partly compressible
+		data[j] = j % 7 < 3 ? 'a' + j % 5 : s >> 16;
+	}
+	return data;
+}
+
+static uint16_t entry_type(unsigned i)
+{
+	return i % 3 == 2 ? AWD_MP3 : AWD_PCM;
+}
+
+static void roundtrip(const char *what, const struct arc_metadata *meta, unsigned flags,
+		unsigned nr_files)
+{
+	struct archive_writer *w = archive_writer_new(meta, flags);
+	if (!w) {
+		fail(what, "archive_writer_new failed");
+		return;
+	}
+	for (unsigned i = 0; i < nr_files; i++) {
+		char name[32];
+		sprintf(name, "F%04u.BIN", i);
+		uint8_t *data = entry_data(i);
+		struct awd_file_metadata awd = {
+			.type = entry_type(i),
+			.loop_start = i,
+			.loop_end = i * 10,
+		};
+		archive_writer_add(w, name, data, entry_size(i), &awd);
+		free(data);
+	}
+	const char *path = tmp_paths[meta->type];
+	bool ok = archive_writer_write(w, path, 0);
+	archive_writer_free(w);
+	if (!ok) {
+		fail(what, "archive_writer_write failed");
+		return;
+	}
+
+	struct archive *arc = archive_open(path, flags);
+	if (!arc) {
+		fail(what, "archive_open failed");
+		return;
+	}
+	if (arc->meta.type != meta->type || arc->meta.nr_files != nr_files) {
+		fail(what, "wrong type or file count");
+		goto end;
+	}
+	const bool awd = meta->type == ARCHIVE_TYPE_AWD || meta->type == ARCHIVE_TYPE_AWF;
+	for (unsigned i = 0; i < nr_files; i++) {
+		char name[32];
+		sprintf(name, "F%04u.BIN", i);
+		struct archive_data *d = archive_get(arc, name);
+		if (!d) {
+			fail(what, "entry not found");
+			continue;
+		}
+		// PCM entries are returned as WAV files
+		const size_t off = awd && d->meta.type == AWD_PCM ? 44 : 0;
+		uint8_t *data = entry_data(i);
+		if (d->size != entry_size(i) + off || memcmp(d->data + off, data, entry_size(i)))
+			fail(what, "wrong entry data");
+		if (awd && (d->meta.loop_start != i || d->meta.loop_end != i * 10))
+			fail(what, "wrong loop points");
+		if (meta->type == ARCHIVE_TYPE_AWD && d->meta.type != entry_type(i))
+			fail(what, "wrong AWD entry type");
+		free(data);
+		archive_data_release(d);
+	}
+end:
+	archive_close(arc);
+}
+
+static void test_typical(void)
+{
+	ai5_target_game = GAME_YUNO;
+	struct arc_metadata meta;
+	for (int type = ARCHIVE_TYPE_ARC; type <= ARCHIVE_TYPE_AWF; type++) {
+		archive_writer_default_metadata(type, &meta);
+		roundtrip("default metadata", &meta, 0, 3);
+		roundtrip("default metadata", &meta, 0, 300);
+	}
+
+	// every name length and field order detected by the reader
+	static const unsigned name_lengths[] = { 0xc, 0x10, 0x14, 0x1e, 0x20, 0x100 };
+	for (int i = 0; i < 6; i++) {
+		for (int reversed = 0; reversed < 2; reversed++) {
+			archive_writer_default_metadata(ARCHIVE_TYPE_ARC, &meta);
+			meta.name_length = name_lengths[i];
+			meta.entry_size = name_lengths[i] + 8;
+			meta.name_key = 0x5a + i;
+			meta.offset_off = reversed ? name_lengths[i] + 4 : name_lengths[i];
+			meta.size_off = reversed ? name_lengths[i] : name_lengths[i] + 4;
+			meta.offset_key = 0x12345678 * (i + 1);
+			meta.size_key = 0x9abcdef0 ^ i;
+			roundtrip("ARC cipher", &meta, 0, 50);
+		}
+	}
+
+	archive_writer_default_metadata(ARCHIVE_TYPE_DAT, &meta);
+	meta.offset_key = meta.size_key = 0xdeadbeef;
+	meta.name_key = 0x33;
+	roundtrip("DAT cipher", &meta, 0, 40);
+	roundtrip("DAT cipher (raw)", &meta, ARCHIVE_RAW, 40);
+
+	// old AWD format (Shuusaku CD version), with a header over 64 KB
+	archive_writer_default_metadata(ARCHIVE_TYPE_AWD, &meta);
+	meta.offset_off += 2;
+	meta.size_off += 2;
+	meta.loop_start_off += 2;
+	meta.loop_end_off += 2;
+	meta.entry_size += 2;
+	roundtrip("old AWD", &meta, 0, 1700);
+
+	// bitwise LZSS
+	ai5_target_game = GAME_KAWARAZAKIKE;
+	archive_writer_default_metadata(ARCHIVE_TYPE_ARC, &meta);
+	roundtrip("AIWIN ARC", &meta, 0, 20);
+}
+
+static void test_game_specific(void)
+{
+	static const enum ai5_game_id games[] = {
+		GAME_DOUKYUUSEI2_DL, GAME_KAKYUUSEI, GAME_KISAKU_ANIM
+	};
+	struct arc_metadata meta;
+	for (int i = 0; i < 3; i++) {
+		ai5_target_game = games[i];
+		archive_writer_default_metadata(ARCHIVE_TYPE_ARC, &meta);
+		if (meta.scheme != ARCHIVE_SCHEME_GAME_SPECIFIC)
+			fail("game-specific", "default metadata has typical scheme");
+		roundtrip("game-specific", &meta, 0, 60);
+		roundtrip("game-specific (raw)", &meta, ARCHIVE_RAW, 60);
+
+		// the layout comes from the game, not the given metadata
+		ai5_target_game = GAME_YUNO;
+		archive_writer_default_metadata(ARCHIVE_TYPE_ARC, &meta);
+		ai5_target_game = games[i];
+		roundtrip("game-specific (typical layout)", &meta, 0, 60);
+	}
+}
+
+static void test_invalid(void)
+{
+	ai5_target_game = GAME_YUNO;
+	struct arc_metadata meta;
+	struct archive_writer *w;
+
+	archive_writer_default_metadata(ARCHIVE_TYPE_ARC, &meta);
+	meta.scheme = ARCHIVE_SCHEME_GAME_SPECIFIC;
+	if ((w = archive_writer_new(&meta, 0))) {
+		fail("invalid metadata", "accepted game-specific scheme without a game");
+		archive_writer_free(w);
+	}
+
+	archive_writer_default_metadata(ARCHIVE_TYPE_ARC, &meta);
+	meta.entry_size = 0x26;
+	if ((w = archive_writer_new(&meta, 0))) {
+		fail("invalid metadata", "accepted size field past the end of the entry");
+		archive_writer_free(w);
+	}
+
+	archive_writer_default_metadata(ARCHIVE_TYPE_AWD, &meta);
+	meta.loop_end_off = UINT32_MAX - 1;
+	if ((w = archive_writer_new(&meta, 0))) {
+		fail("invalid metadata", "accepted loop end field past the end of the entry");
+		archive_writer_free(w);
+	}
+}
+
+int main(void)
+{
+	test_typical();
+	test_game_specific();
+	test_invalid();
+	for (int type = ARCHIVE_TYPE_ARC; type <= ARCHIVE_TYPE_AWF; type++) {
+		remove(tmp_paths[type]);
+	}
+	if (nr_failed)
+		printf("%u failures\n", nr_failed);
+	return nr_failed ? 1 : 0;
+}